@@ -14,34 +14,57 @@
 */
 
 #include <unistd.h>
+#include <math.h>
+
+#include <thread>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
 
 #include "boinc_api.h"
 #include "boinc_opencl.h"
 #include "simpleCL.h"
 
-#include "clearn.h"
+#include "control.h"
 #include "clearresult.h"
+#include "scan.h"
+#include "factorbuf.h"
+#include "goodfactor.h"
+#include "presieve.h"
 #include "getsegprimes.h"
 #include "sieve.h"
 #include "sievecw.h"
 #include "setup.h"
 #include "check.h"
+#include "segsieve.h"
 
 #include "primesieve.h"
 #include "factor_proth.h"
 #include "verify_factor.h"
 #include "putil.h"
 #include "cl_sieve.h"
+#include "cpu_sieve.h"
+#include "pool.h"
+
+// control block layout, shared with the kernels
+#include "control.cl"
 
 #define RESULTS_FILENAME "factors.txt"
 #define STATE_FILENAME_A "PCWstateA.txt"
 #define STATE_FILENAME_B "PCWstateB.txt"
+#define TUNE_FILENAME "PCWtune.txt"
+#define BOX_FILENAME "PCWbox%u.txt"
 
-using namespace std; 
+// sieve work-items launched per compute unit in persistent mode, enough to keep each unit busy
+#define PERSISTENT_THREADS 2048
 
+// the Eratosthenes generator's sieving primes go to at most 2^28, about 14.6M primes or 58MB on the device and host
+#define ERATO_MAX_SIEVE (1u << 28)
 
-// 16 megabytes of device memory for factors found
-const uint32_t numresults = 1000000u;
+using namespace std; 
 
 
 void handle_trickle_up(searchData & sd)
@@ -86,59 +109,168 @@ FILE *my_fopen(const char * filename, const char * mode)
 }
 
 
+// device buffers and kernels of one search box.  all boxes share the prime generator's output and Ps.
+typedef struct {
+
+	// results go to one of two slots, swapped at each checkpoint.  the kernels write one while
+	// the host reads the other, see startRead and collectResults.
+	cl_mem d_factorP[2] = {NULL, NULL};
+	cl_mem d_factorKN[2] = {NULL, NULL};
+	cl_mem d_ctl[2] = {NULL, NULL};		// control block, see control.cl
+
+	// pinned host copies.  the control block and factors of the slot being read, and the control
+	// block header read without blocking after each batch, alternating between two copies.
+	cl_mem p_factorP = NULL, p_factorKN = NULL, p_ctl = NULL, p_head = NULL;
+	int64_t * h_factorP = NULL;
+	cl_uint2 * h_factorKN = NULL;
+	uint32_t * h_ctl = NULL;
+	uint32_t * h_head = NULL;
+
+	cl_mem d_K[2] = {NULL, NULL};	// one per batch slot, see progData
+	cl_mem d_lK[2] = {NULL, NULL};
+
+	sclSoft sieve, setup, check, clearresult;
+	sclSoft sieve_lanes[9];		// each sieve kernel kind with 1, 2 and 4 primes per work-item, see sieveIndex.  sieve is the one in use
+	uint32_t kinds = 1;		// bit mask of the kinds built for this box, the 32 step or sm kernel is always there
+
+	uint32_t maxfactors = 0;	// size of each slot's d_factorP and d_factorKN
+
+	vector<int8_t> verdict;		// checkFactor result of each factor read, filled in by the verify pool
+
+	cl_event sieve_event = NULL;	// first sieve launch of the last batch, for retune
+
+}boxData;
+
+// true if sieve_lanes[v] was built for the box
+bool hasSieve( boxData & bd, uint32_t v ){
+
+	return (bd.kinds >> (v / 3)) & 1;
+}
+
+
 typedef struct {
 
 	uint32_t range;
 	uint32_t psize;
 	uint32_t numgroups;
+	uint64_t maxrange;	// largest range the prime generator's buffers allow
+
+	cl_event gen_event = NULL;	// prime generator count pass of the last batch, for retune
+
+	// profile range and its prime count, counted on the host while the kernels build
+	uint64_t prof_start;
+	uint64_t prof_range;
+	uint64_t prof_range_primes;
 
-	cl_mem d_factorP = NULL;
-	cl_mem d_factorKN = NULL;
-	cl_mem d_factorcount = NULL;
+	// batches alternate between two slots of primes, Ps, K and lK.  a batch's prime generator and setup
+	// run on gen_queue while the batch before it sieves on the main queue.
+	cl_mem d_primes[2] = {NULL, NULL};
+	cl_mem d_primecount[2] = {NULL, NULL};
 
-	cl_mem d_flag = NULL;
-	cl_mem d_checksum = NULL;
+	cl_mem d_Ps[2] = {NULL, NULL};
 
-	cl_mem d_primes = NULL;
-	cl_mem d_primecount = NULL;
+	cl_command_queue gen_queue = NULL;
 
-	cl_mem d_Ps = NULL;
-	cl_mem d_K = NULL;
-	cl_mem d_lK = NULL;
+	// result slot the kernels write, and the read of the other one: 0 none, 1 checksums and
+	// counts queued, 2 factors queued, 3 factors being verified.  it covers the search up to read_p.
+	uint32_t rslot = 0;
+	uint32_t rstate = 0;
+	cl_event read_event = NULL;
+	uint64_t read_p;
+	uint64_t head_batch = 0;	// first batch whose control block header read is of slot rslot
 
-	sclSoft sieve, clearn, clearresult, setup, check, getsegprimes;
+	workPool * verify = NULL;		// factor verification threads
+
+	// the prime generator's count pass, getsegprimes or segsieve, leaves each work-group's primes in d_bits
+	// and its count in d_gcount.  primescan and primewrite put them in ascending order in the batch slot.
+	sclSoft getsegprimes, primescan, primewrite;
+	cl_mem d_bits = NULL;
+	cl_mem d_gcount = NULL;
+
+	vector<boxData> box;
+
+	// segmented sieve of Eratosthenes prime generator, used instead of getsegprimes when erato is set
+	bool erato = false;
+	uint32_t * h_sprimes = NULL;	// odd sieving primes to sqrt(pmax)
+	uint32_t nsprimes;
+	uint32_t nsmall;		// sieving primes below one segment, sieved in local memory
+	uint32_t ncoop;			// small primes marked by the whole work-group
+	cl_mem d_sprimes = NULL;
+	sclSoft segclear, segmark, segsieve;
 
 }progData;
 
 
-void cleanup( progData pd ){
-	sclReleaseMemObject(pd.d_factorP);
-	sclReleaseMemObject(pd.d_factorKN);
-	sclReleaseMemObject(pd.d_factorcount);
+void cleanup( progData & pd, sclHard hardware ){
+
+	delete pd.verify;
+	pd.verify = NULL;
+
+	for(auto & b : pd.box){
+		for(uint32_t s = 0; s < 2; ++s){
+			sclReleaseMemObject(b.d_factorP[s]);
+			sclReleaseMemObject(b.d_factorKN[s]);
+			sclReleaseMemObject(b.d_ctl[s]);
+
+			sclReleaseMemObject(b.d_K[s]);
+			sclReleaseMemObject(b.d_lK[s]);
+		}
+
+		sclFreePinned(hardware, b.p_factorP, b.h_factorP);
+		sclFreePinned(hardware, b.p_factorKN, b.h_factorKN);
+		sclFreePinned(hardware, b.p_ctl, b.h_ctl);
+		sclFreePinned(hardware, b.p_head, b.h_head);
+
+		sclReleaseClSoft(b.clearresult);
+		for(uint32_t v = 0; v < 9; ++v){
+			if(hasSieve(b, v)) sclReleaseClSoft(b.sieve_lanes[v]);
+		}
+		sclReleaseClSoft(b.setup);
+		sclReleaseClSoft(b.check);
+
+		if(b.sieve_event != NULL){
+			clReleaseEvent(b.sieve_event);
+		}
+	}
 
-	sclReleaseMemObject(pd.d_flag);
-	sclReleaseMemObject(pd.d_checksum);
+	if(pd.gen_event != NULL){
+		clReleaseEvent(pd.gen_event);
+	}
 
-	sclReleaseMemObject(pd.d_primes);
-	sclReleaseMemObject(pd.d_primecount);
+	for(uint32_t s = 0; s < 2; ++s){
+		sclReleaseMemObject(pd.d_primes[s]);
+		sclReleaseMemObject(pd.d_primecount[s]);
+		sclReleaseMemObject(pd.d_Ps[s]);
+	}
 
-	sclReleaseMemObject(pd.d_Ps);
-	sclReleaseMemObject(pd.d_K);
-	sclReleaseMemObject(pd.d_lK);
+	if(pd.gen_queue != NULL){
+		clReleaseCommandQueue(pd.gen_queue);
+	}
 
-	sclReleaseClSoft(pd.clearn);
-	sclReleaseClSoft(pd.clearresult);
-        sclReleaseClSoft(pd.sieve);
-        sclReleaseClSoft(pd.setup);
-        sclReleaseClSoft(pd.check);
         sclReleaseClSoft(pd.getsegprimes);
+        sclReleaseClSoft(pd.primescan);
+        sclReleaseClSoft(pd.primewrite);
+        sclReleaseClSoft(pd.segclear);
+        sclReleaseClSoft(pd.segmark);
+        sclReleaseClSoft(pd.segsieve);
+
+	sclReleaseMemObject(pd.d_sprimes);
+	sclReleaseMemObject(pd.d_bits);
+	sclReleaseMemObject(pd.d_gcount);
+
+	if(pd.h_sprimes != NULL){
+		primesieve_free(pd.h_sprimes);
+	}
 
 }
 
 
-void write_state( searchData & sd ){
+// the first line is the shared state and box 0's results, then checksum and factorcount of any other boxes
+void write_state( searchData * box ){
 
 	FILE *out;
+	searchData & sd = box[0];
+	int ok = 1;
 
         if (sd.write_state_a_next){
 		if ((out = my_fopen(STATE_FILENAME_A,"w")) == NULL)
@@ -149,6 +281,14 @@ void write_state( searchData & sd ){
                         fprintf(stderr,"Cannot open %s !!!\n",STATE_FILENAME_B);
         }
 	if (fprintf(out,"%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",sd.workunit,sd.p,sd.primecount,sd.checksum,sd.factorcount,sd.last_trickle) < 0){
+		ok = 0;
+	}
+	for(uint32_t b = 1; ok && b < sd.nbox; ++b){
+		if (fprintf(out,"%" PRIu64 " %" PRIu64 "\n",box[b].checksum,box[b].factorcount) < 0){
+			ok = 0;
+		}
+	}
+	if (!ok){
 		if (sd.write_state_a_next)
 			fprintf(stderr,"Cannot write to %s !!! Continuing...\n",STATE_FILENAME_A);
 		else
@@ -165,13 +305,119 @@ void write_state( searchData & sd ){
 	}
 }
 
+// autotune results, one line per device, box and search class:
+// device hash, box, cw, compute, nstep, wstep, fp64, erato, fused, range, psize, kernel_nstep, lanes, kind
+static bool parse_tune( const char * line, uint64_t & device, uint32_t * key, uint32_t * val ){
+
+	return sscanf(line, "%" SCNx64 " %u %u %u %u %u %u %u %u %u %u %u %u %u", &device, &key[0], &key[1], &key[2], &key[3], &key[4], &key[5], &key[6],
+			&key[7], &val[0], &val[1], &val[2], &val[3], &val[4]) == 14;
+
+}
+
+static bool tune_match( progData & pd, searchData & sd, uint32_t * key ){
+
+	return key[0] == sd.box && key[1] == (uint32_t)sd.cw && key[2] == (uint32_t)sd.compute && key[3] == sd.nstep && key[4] == sd.wstep
+		&& key[5] == (uint32_t)fp64Range(sd) && key[6] == (uint32_t)pd.erato && key[7] == (uint32_t)sd.fused;
+
+}
+
+
+/* Return true if profile results for this device, box and search class were saved
+   by an earlier run, so profileGPU and the first sieve profile can be skipped.
+   The shared batch range and prime array size saved with them go to range and psize.
+ */
+bool read_tune( progData & pd, searchData & sd, uint64_t devicehash, uint32_t & range, uint32_t & psize ){
+
+	FILE *in;
+	char line[256];
+	uint64_t device;
+	uint32_t key[8], val[5];
+	bool found = false;
+
+	if ((in = my_fopen(TUNE_FILENAME,"r")) == NULL){
+		return false;
+	}
+
+	while(fgets(line, sizeof(line), in) != NULL){
+		if( parse_tune(line, device, key, val) && device == devicehash && tune_match(pd, sd, key) ){
+			// sanity check
+			if( val[0] > 0 && val[1] > 0 && val[2] >= sd.nstep && (val[2] % sd.nstep) == 0 && (val[3] == 1 || val[3] == 2 || val[3] == 4)
+					&& (val[4] == 0 || (val[4] == 1 && sd.wstep > 0) || (val[4] == 2 && fp64Range(sd))) ){
+				range = val[0];
+				psize = val[1];
+				sd.kernel_nstep = val[2];
+				sd.lanes = val[3];
+				sd.kind = val[4];
+				found = true;
+			}
+		}
+	}
+
+	fclose(in);
+
+	return found;
+}
+
+
+// save profile results, replacing any for the same device and search class
+void write_tune( progData & pd, searchData & sd, uint64_t devicehash ){
+
+	FILE *in, *out;
+	char line[256];
+	uint64_t device;
+	uint32_t key[8], val[5];
+	vector<string> keep;
+
+	if ((in = my_fopen(TUNE_FILENAME,"r")) != NULL){
+		while(fgets(line, sizeof(line), in) != NULL){
+			if( parse_tune(line, device, key, val) && !(device == devicehash && tune_match(pd, sd, key)) ){
+				keep.push_back(line);
+			}
+		}
+		fclose(in);
+	}
+
+	if ((out = my_fopen(TUNE_FILENAME,"w")) == NULL){
+		fprintf(stderr,"Cannot open %s !!!\n",TUNE_FILENAME);
+		return;
+	}
+
+	for(auto & l : keep){
+		fputs(l.c_str(), out);
+	}
+
+	if (fprintf(out,"%016" PRIx64 " %u %u %u %u %u %u %u %u %u %u %u %u %u\n", devicehash, sd.box, (uint32_t)sd.cw, (uint32_t)sd.compute, sd.nstep, sd.wstep,
+			(uint32_t)fp64Range(sd), (uint32_t)pd.erato, (uint32_t)sd.fused, pd.range, pd.psize, sd.kernel_nstep, sd.lanes, sd.kind) < 0){
+		fprintf(stderr,"Cannot write to %s !!! Continuing...\n",TUNE_FILENAME);
+	}
+
+	fclose(out);
+}
+
+
+// checksum and factorcount of boxes 1 and up, after the first line of a state file
+static bool read_box_state( FILE * in, searchData * box, vector<uint64_t> & boxstate ){
+
+	boxstate.resize( 2 * box[0].nbox );
+
+	for(uint32_t b = 1; b < box[0].nbox; ++b){
+		if (fscanf(in,"%" PRIu64 " %" PRIu64 "\n",&boxstate[2*b],&boxstate[2*b+1]) != 2){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
 /* Return 1 only if a valid checkpoint can be read.
    Attempts to read from both state files,
    uses the most recent one available.
  */
-int read_state( searchData & sd ){
+int read_state( searchData * box ){
 
 	FILE *in;
+	searchData & sd = box[0];
 	bool good_state_a = true;
 	bool good_state_b = true;
 	uint64_t workunit_a, workunit_b;
@@ -180,14 +426,17 @@ int read_state( searchData & sd ){
 	uint64_t checksum_a, checksum_b;
 	uint64_t factorcount_a, factorcount_b;
 	uint64_t trickle_a, trickle_b;
+	vector<uint64_t> boxstate_a, boxstate_b;
 
         // Attempt to read state file A
 	if ((in = my_fopen(STATE_FILENAME_A,"r")) == NULL){
 		good_state_a = false;
         }
-	else if (fscanf(in,"%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",&workunit_a,&current_a,&primecount_a,&checksum_a,&factorcount_a,&trickle_a) != 6){
+	else if (fscanf(in,"%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",&workunit_a,&current_a,&primecount_a,&checksum_a,&factorcount_a,&trickle_a) != 6
+			|| !read_box_state(in, box, boxstate_a)){
 		fprintf(stderr,"Cannot parse %s !!!\n",STATE_FILENAME_A);
 		good_state_a = false;
+		fclose(in);
 	}
 	else{
 		fclose(in);
@@ -201,9 +450,11 @@ int read_state( searchData & sd ){
         if ((in = my_fopen(STATE_FILENAME_B,"r")) == NULL){
                 good_state_b = false;
         }
-	else if (fscanf(in,"%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",&workunit_b,&current_b,&primecount_b,&checksum_b,&factorcount_b,&trickle_b) != 6){
+	else if (fscanf(in,"%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",&workunit_b,&current_b,&primecount_b,&checksum_b,&factorcount_b,&trickle_b) != 6
+			|| !read_box_state(in, box, boxstate_b)){
                 fprintf(stderr,"Cannot parse %s !!!\n",STATE_FILENAME_B);
                 good_state_b = false;
+		fclose(in);
         }
         else{
                 fclose(in);
@@ -231,6 +482,10 @@ int read_state( searchData & sd ){
 		sd.factorcount = factorcount_a;
 		sd.last_trickle = trickle_a;
 		sd.write_state_a_next = false;
+		for(uint32_t b = 1; b < sd.nbox; ++b){
+			box[b].checksum = boxstate_a[2*b];
+			box[b].factorcount = boxstate_a[2*b+1];
+		}
 		return 1;
 	}
         if (good_state_b && !good_state_a)
@@ -241,6 +496,10 @@ int read_state( searchData & sd ){
 		sd.factorcount = factorcount_b;
 		sd.last_trickle = trickle_b;
 		sd.write_state_a_next = true;
+		for(uint32_t b = 1; b < sd.nbox; ++b){
+			box[b].checksum = boxstate_b[2*b];
+			box[b].factorcount = boxstate_b[2*b+1];
+		}
 		return 1;
         }
 
@@ -249,32 +508,86 @@ int read_state( searchData & sd ){
 }
 
 
-void checkpoint( searchData & sd ){
+void checkpoint( searchData * box ){
 
-	handle_trickle_up( sd );
+	handle_trickle_up( box[0] );
 
-	write_state( sd );
+	write_state( box );
 
 	if(boinc_is_standalone()){
-		printf("Checkpoint, current p: %" PRIu64 "\n", sd.p);
+		printf("Checkpoint, current p: %" PRIu64 "\n", box[0].p);
 	}
 
 	boinc_checkpoint_completed();
 }
 
 
-// sleep CPU thread while waiting on the specified event to complete in the command queue
-// using critical sections to prevent BOINC from shutting down the program while kernels are running on the GPU
-void waitOnEvent(sclHard hardware, cl_event event){
+// true once a launch has finished, never waits
+bool eventDone( cl_event event ){
 
-	cl_int err;
 	cl_int info;
+
+	cl_int err = clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &info, NULL);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clGetEventInfo\n" );
+		fprintf(stderr, "ERROR: clGetEventInfo\n" );
+		sclPrintErrorFlags( err );
+		return false;
+	}
+
+	return info == CL_COMPLETE;
+}
+
+
+// host waits on the GPU.  the event's completion callback wakes the thread instead of polling every 1ms.
+// with --spin the thread polls for up to that many us first, while the last wait was about that short.
+static uint32_t spin_us = 0;
+static double last_wait_us = 0.0;
+
+// completion flag and execution status set by the OpenCL runtime's callback thread
+typedef struct {
+
+	mutex m;
+	condition_variable cv;
+	bool done = false;
+	cl_int status = CL_COMPLETE;	// negative if the command ended abnormally
+
+}eventWaiter;
+
+static void CL_CALLBACK eventComplete( cl_event event, cl_int status, void * data ){
+
+	eventWaiter * w = (eventWaiter *)data;
+
+	// notify under the lock, the waiter is gone as soon as it sees done
+	lock_guard<mutex> lock(w->m);
+	w->status = status;
+	w->done = true;
+	w->cv.notify_one();
+}
+
+
+// CPU time of the calling thread in seconds, for the host CPU use report
+static double threadCPUTime(){
+
 #ifdef _WIN32
+	FILETIME c, e, k, u;
+	GetThreadTimes(GetCurrentThread(), &c, &e, &k, &u);
+	uint64_t t = ((uint64_t)k.dwHighDateTime << 32 | k.dwLowDateTime) + ((uint64_t)u.dwHighDateTime << 32 | u.dwLowDateTime);
+	return (double)t * 1e-7;
 #else
-	struct timespec sleep_time;
-	sleep_time.tv_sec = 0;
-	sleep_time.tv_nsec = 1000000;	// 1ms
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
 #endif
+}
+
+
+// sleep CPU thread while waiting on the specified event to complete in the command queue
+// using critical sections to prevent BOINC from shutting down the program while kernels are running on the GPU
+void waitOnEvent(sclHard hardware, cl_event event){
+
+	cl_int err;
+	eventWaiter w;
 
 	boinc_begin_critical_section();
 
@@ -285,34 +598,44 @@ void waitOnEvent(sclHard hardware, cl_event event){
 		sclPrintErrorFlags( err );
        	}
 
-	while(true){
+	auto start = chrono::steady_clock::now();
 
-#ifdef _WIN32
-		Sleep(1);
-#else
-		nanosleep(&sleep_time,NULL);
-#endif
+	// short waits cost less polled than slept and woken
+	if(spin_us > 0 && last_wait_us < 2.0 * spin_us){
+		while( !eventDone(event) && chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() < spin_us );
+	}
 
-		err = clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &info, NULL);
+	if(!eventDone(event)){
+		err = clSetEventCallback(event, CL_COMPLETE, eventComplete, &w);
 		if ( err != CL_SUCCESS ) {
-			printf( "ERROR: clGetEventInfo\n" );
-			fprintf(stderr, "ERROR: clGetEventInfo\n" );
+			printf( "ERROR: clSetEventCallback\n" );
+			fprintf(stderr, "ERROR: clSetEventCallback\n" );
 			sclPrintErrorFlags( err );
-	       	}
+			w.status = clWaitForEvents(1, &event);
+		}
+		else{
+			unique_lock<mutex> lock(w.m);
+			w.cv.wait(lock, [&w]{ return w.done; });
+		}
+	}
 
-		if(info == CL_COMPLETE){
-			err = clReleaseEvent(event);
-			if ( err != CL_SUCCESS ) {
-				printf( "ERROR: clReleaseEvent\n" );
-				fprintf(stderr, "ERROR: clReleaseEvent\n" );
-				sclPrintErrorFlags( err );
-		       	}
+	// a command that ended abnormally completes the event too, its results are garbage
+	if(w.status < 0){
+		printf( "ERROR: OpenCL command failed\n" );
+		fprintf(stderr, "ERROR: OpenCL command failed\n" );
+		sclPrintErrorFlags( w.status );
+	}
 
-			boinc_end_critical_section();
+	last_wait_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
 
-			return;
-		}
-	}
+	err = clReleaseEvent(event);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clReleaseEvent\n" );
+		fprintf(stderr, "ERROR: clReleaseEvent\n" );
+		sclPrintErrorFlags( err );
+       	}
+
+	boinc_end_critical_section();
 }
 
 
@@ -321,15 +644,6 @@ void sleepCPU(sclHard hardware){
 
 	cl_event kernelsDone;
 	cl_int err;
-	cl_int info;
-#ifdef _WIN32
-#else
-	struct timespec sleep_time;
-	sleep_time.tv_sec = 0;
-	sleep_time.tv_nsec = 1000000;	// 1ms
-#endif
-
-	boinc_begin_critical_section();
 
 	// OpenCL v2.0
 /*
@@ -347,351 +661,1002 @@ void sleepCPU(sclHard hardware){
 		sclPrintErrorFlags(err); 
 	}
 
-	err = clFlush(hardware.queue);
-	if ( err != CL_SUCCESS ) {
-		printf( "ERROR: clFlush\n" );
-		fprintf(stderr, "ERROR: clFlush\n" );
-		sclPrintErrorFlags( err );
-       	}
+	waitOnEvent(hardware, kernelsDone);
+}
 
-	while(true){
 
-#ifdef _WIN32
-		Sleep(1);
-#else
-		nanosleep(&sleep_time,NULL);
-#endif
+// getsegprimes presieves with the odd primes to this limit, then PRP tests what's left.
+// the tables go to PRESIEVE_LIMIT in the Makefile, see --bench for timing other depths
+const uint32_t presieve_limit = 1024;
 
-		err = clGetEventInfo(kernelsDone, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &info, NULL);
-		if ( err != CL_SUCCESS ) {
-			printf( "ERROR: clGetEventInfo\n" );
-			fprintf(stderr, "ERROR: clGetEventInfo\n" );
-			sclPrintErrorFlags( err );
-	       	}
+// odd numbers per getsegprimes thread is 64
+uint32_t presieveThreads( uint64_t range ){
 
-		if(info == CL_COMPLETE){
-			err = clReleaseEvent(kernelsDone);
-			if ( err != CL_SUCCESS ) {
-				printf( "ERROR: clReleaseEvent\n" );
-				fprintf(stderr, "ERROR: clReleaseEvent\n" );
-				sclPrintErrorFlags( err );
-		       	}
+	return (uint32_t)( (range / 128) + 1 );
+}
 
-			boinc_end_critical_section();
+// getsegprimes work-group size in words of the prime bitmap, GROUP_SPAN / 64 in getsegprimes.cl
+const uint32_t presieve_words = 512;
 
-			return;
-		}
-	}
-}
 
+// segsieve work-group size in words and odd numbers, same as SEG_WORDS in segsieve.cl
+const uint32_t seg_words = 4096;
+const uint32_t seg_bits = seg_words * 32;
 
-// find mod 30 wheel index based on starting N
-// this is used by gpu threads to iterate over the number line
-void findWheelOffset(uint64_t & start, int32_t & index){
 
-	int32_t wheel[8] = {4, 2, 4, 2, 4, 6, 2, 6};
-	int32_t idx = -1;
+// number of segsieve work-groups for a batch of range numbers
+uint32_t segGroups( uint64_t range ){
 
-	// find starting number using mod 6 wheel
-	// N=(k*6)-1, N=(k*6)+1 ...
-	// where k, k+1, k+2 ...
-	uint64_t k = start / 6;
-	int32_t i = 1;
-	uint64_t N = (k * 6)-1;
+	uint64_t nbits = (range + 1) / 2;
 
+	return (uint32_t)( (nbits + seg_bits - 1) / seg_bits );
+}
 
-	while( N < start || N % 5 == 0 ){
-		if(i){
-			i = 0;
-			N += 2;
-		}
-		else{
-			i = 1;
-			N += 4;
-		}
-	}
 
-	start = N;
+// bitmap words of one prime generator work-group, and the work-groups for a batch of range numbers
+uint32_t genWords( progData & pd ){
 
-	// find mod 30 wheel index by iterating with a mod 6 wheel until finding N divisible by 5
-	// forward to find index
-	while(idx < 0){
+	return (pd.erato) ? seg_words : presieve_words;
+}
 
-		if(i){
-			N += 2;
-			i = 0;
-			if(N % 5 == 0){
-				N -= 2;
-				idx = 5;
-			}
+uint32_t genGroups( progData & pd, uint64_t range ){
 
-		}
-		else{
-			N += 4;
-			i = 1;
-			if(N % 5 == 0){
-				N -= 4;
-				idx = 7;
-			}
-		}
-	}
+	return (pd.erato) ? segGroups(range) : (presieveThreads(range) + 255) / 256;
+}
 
-	// reverse to find starting index
-	while(N != start){
-		--idx;
-		if(idx < 0)idx=7;
-		N -= wheel[idx];
-	}
 
+// size the prime generator's three passes for batches of range numbers
+void setGenSize( progData & pd, uint64_t range ){
 
-	index = idx;
+	uint32_t ngroups = genGroups(pd, range);
 
+	sclSetGlobalSize( (pd.erato) ? pd.segsieve : pd.getsegprimes, ngroups * 256 );
+	sclSetKernelArg(pd.primescan, 1, sizeof(uint32_t), &ngroups);
+	sclSetGlobalSize( pd.primewrite, ngroups * 256 );
 }
 
 
-void report_solution( char * results ){
-
-	FILE * resfile = my_fopen(RESULTS_FILENAME,"a");
+// largest sieving prime the Eratosthenes generator needs.  profileGPU's range can start at pmax
+uint64_t eratoLimit( const searchData & sd ){
 
-	if( resfile == NULL ){
-		fprintf(stderr,"Cannot open %s !!!\n",RESULTS_FILENAME);
-		exit(EXIT_FAILURE);
-	}
+	return (uint64_t)sqrtl( (long double)(sd.pmax + 4294967296ULL) ) + 1;
+}
 
-	if( fprintf( resfile, "%s", results ) < 0 ){
-		fprintf(stderr,"Cannot write to %s !!!\n",RESULTS_FILENAME);
-		exit(EXIT_FAILURE);
-	}
 
-	fclose(resfile);
+// the prime generator follows from the workunit, never the device, so every host in a quorum sieves the
+// same primes.  with sieving primes to ERATO_MAX_SIEVE, pmax < 2^56, the Eratosthenes generator is used
+// and the CPU engine drops spsp(2) too.  above that getsegprimes and the CPU engine keep them.
+bool eratoRange( const searchData & sd ){
 
+	return eratoLimit(sd) <= ERATO_MAX_SIEVE;
 }
 
 
-void getResults( progData pd, searchData & sd, sclHard hardware ){
+// use the segmented sieve prime generator when the workunit is in eratoRange
+void setupSegSieve( progData & pd, searchData & sd, sclHard hardware ){
 
-	uint64_t * h_checksum = (uint64_t *)malloc(pd.numgroups*sizeof(uint64_t));
-	if( h_checksum == NULL ){
-		fprintf(stderr,"malloc error\n");
-		exit(EXIT_FAILURE);
+	if( !eratoRange(sd) ){
+		pd.erato = false;
+		return;
 	}
 
-	// copy checksum and total prime count to host memory
-	// blocking read
-	sclRead(hardware, pd.numgroups*sizeof(uint64_t), pd.d_checksum, h_checksum);
+	uint64_t limit = eratoLimit(sd);
 
-	// index 0 is the gpu's total prime count
-	sd.primecount += h_checksum[0];
+	// the cap is well under the smallest allocation OpenCL guarantees, but check before generating them.
+	// falling back to getsegprimes would change the primes sieved.
+	cl_ulong maxalloc;
+	clGetDeviceInfo( hardware.device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxalloc, NULL );
 
-	// sum block checksums
-	for(uint32_t i=1; i<pd.numgroups; ++i){
-		sd.checksum += h_checksum[i];
-	}
+	double estimate = 1.1 * (double)limit / log( (double)limit );
 
-	uint32_t * h_flag = (uint32_t *)malloc(sizeof(uint32_t));
-	if( h_flag == NULL ){
-		fprintf(stderr,"malloc error\n");
+	if( estimate * sizeof(uint32_t) > (double)(maxalloc / 2) ){
+		fprintf(stderr, "ERROR: device can't hold the sieving primes to %" PRIu64 "\n", limit);
+		printf( "ERROR: device can't hold the sieving primes to %" PRIu64 "\n", limit);
 		exit(EXIT_FAILURE);
 	}
 
-	// copy checksum flag to host memory
-	// blocking read
-	sclRead(hardware, sizeof(uint32_t), pd.d_flag, h_flag);
+	size_t count;
+	pd.h_sprimes = (uint32_t*)primesieve_generate_primes( 3, limit, &count, UINT32_PRIMES );
+	pd.nsprimes = (uint32_t)count;
 
-	// flag set by gpu if there is an internal checksum error
-	if(*h_flag > 0){
-		fprintf(stderr,"error: gpu checksum failure\n");
-		printf("error: gpu checksum failure\n");
-		exit(EXIT_FAILURE);
-	}
+	pd.nsmall = (uint32_t)( lower_bound( pd.h_sprimes, pd.h_sprimes + count, 2 * seg_bits ) - pd.h_sprimes );
 
-	uint32_t * h_primecount = (uint32_t *)malloc(2*sizeof(uint32_t));
-	if( h_primecount == NULL ){
-		fprintf(stderr,"malloc error\n");
-		exit(EXIT_FAILURE);
-	}
+	// a prime below 512 has more than 256 multiples in a segment
+	pd.ncoop = (uint32_t)( lower_bound( pd.h_sprimes, pd.h_sprimes + count, 512 ) - pd.h_sprimes );
 
-	// copy prime count to host memory
-	// blocking read
-	sclRead(hardware, 2*sizeof(uint32_t), pd.d_primecount, h_primecount);
+	pd.erato = true;
+}
 
-	// largest kernel prime count.  used to check array bounds
-	if(h_primecount[1] > pd.psize){
-		fprintf(stderr,"error: gpu prime array overflow\n");
-		printf("error: gpu prime array overflow\n");
-		exit(EXIT_FAILURE);
-	}
 
-	uint32_t * h_factorcount = (uint32_t *)malloc(sizeof(uint32_t));
-	if( h_factorcount == NULL ){
-		fprintf(stderr,"malloc error\n");
-		exit(EXIT_FAILURE);
-	}
+// set the prime generator's args for the batch [start, stop).  returns the global size for segmark, 0 if it doesn't need to run.
+uint32_t setPrimeArgs( progData & pd, uint64_t start, uint64_t stop ){
 
-	// copy factor cnt to host memory
-	// blocking read
-	sclRead(hardware, sizeof(uint32_t), pd.d_factorcount, h_factorcount);
+	sclSetKernelArg(pd.primewrite, 0, sizeof(uint64_t), &start);
 
-//	printf("%u factors found on gpu.  verifying on cpu.\n",*h_factorcount);
+	if(pd.erato){
+		// large sieving primes up to sqrt(stop)
+		uint64_t root = (uint64_t)sqrtl( (long double)(stop - 1) );
+		while( root * root > stop - 1 ) --root;
+		while( (root + 1) * (root + 1) <= stop - 1 ) ++root;
 
-	if(*h_factorcount > 0){
+		uint32_t last = (uint32_t)( upper_bound( pd.h_sprimes, pd.h_sprimes + pd.nsprimes, root ) - pd.h_sprimes );
+		uint32_t nmark = (last > pd.nsmall) ? last - pd.nsmall : 0;
 
-		if(*h_factorcount > numresults){
-			fprintf(stderr,"Error: number of results (%u) overflowed array.\n", *h_factorcount);
-			exit(EXIT_FAILURE);
+		if(nmark){
+			sclSetKernelArg(pd.segmark, 0, sizeof(uint64_t), &start);
+			sclSetKernelArg(pd.segmark, 1, sizeof(uint64_t), &stop);
+			sclSetKernelArg(pd.segmark, 4, sizeof(uint32_t), &last);
+			sclSetGlobalSize( pd.segmark, nmark );
 		}
 
-		int64_t * h_factorP = (int64_t *)malloc(*h_factorcount * sizeof(int64_t));
-		if( h_factorP == NULL ){
-			fprintf(stderr,"malloc error\n");
-			exit(EXIT_FAILURE);
-		}
+		sclSetKernelArg(pd.segsieve, 0, sizeof(uint64_t), &start);
+		sclSetKernelArg(pd.segsieve, 1, sizeof(uint64_t), &stop);
 
-		cl_uint2 * h_factorKN = (cl_uint2 *)malloc(*h_factorcount * sizeof(cl_uint2));
-		if( h_factorKN == NULL ){
-			fprintf(stderr,"malloc error\n");
-			exit(EXIT_FAILURE);
-		}
+		return nmark;
+	}
 
-		// copy factors to host memory
-		// blocking read
-		sclRead(hardware, *h_factorcount * sizeof(int64_t), pd.d_factorP, h_factorP);
-		sclRead(hardware, *h_factorcount * sizeof(cl_uint2), pd.d_factorKN, h_factorKN);
-
-		// sort results by prime size if needed
-		if(*h_factorcount > 1){
-			for (uint32_t i = 0; i < *h_factorcount-1; i++){    
-				for (uint32_t j = 0; j < *h_factorcount-i-1; j++){
-					uint64_t a = (h_factorP[j]<0)?-h_factorP[j]:h_factorP[j];
-					uint64_t b = (h_factorP[j+1]<0)?-h_factorP[j+1]:h_factorP[j+1];
-					if (a > b){
-						swap(h_factorP[j], h_factorP[j+1]);
-						swap(h_factorKN[j], h_factorKN[j+1]);
-					}
-				}
-			}
-		}
+	sclSetKernelArg(pd.getsegprimes, 0, sizeof(uint64_t), &start);
+	sclSetKernelArg(pd.getsegprimes, 1, sizeof(uint64_t), &stop);
 
-		char buffer[256];
-		char * resbuff = (char *)malloc( *h_factorcount * sizeof(char) * 256 );
-		if( resbuff == NULL ){
-			fprintf(stderr,"malloc error\n");
-			exit(EXIT_FAILURE);
+	return 0;
+}
 
-		}
-		resbuff[0] = '\0';
 
-		for(uint32_t m=0; m<*h_factorcount; ++m){
+// persistent mode, for compute cards: one sieve launch per batch walks all of N with k0 in registers,
+// and a fixed number of work-items loop over the primes.  returns a kernel_nstep covering nmin to nmax.
+uint32_t persistentNstep( searchData & sd ){
 
-			int64_t sp;
-			uint64_t p;
-			uint32_t k;
-			uint32_t n;
-			int32_t c;
+	return ((sd.nmax - sd.nmin) / sd.nstep + 1) * sd.nstep;
+}
 
-			// use the sign bit of P for the sign of the factor since its limited to 2^62
-			sp = h_factorP[m];
-			p = (sp < 0)?-sp:sp;
-			k = h_factorKN[m].s0;
-			n = h_factorKN[m].s1;
-			c = (sp < 0)?-1:1;
 
-			if(sd.cw){
+// sieve kernel name suffix and index for each lane count, see LANES in sieve.cl.
+// sieve_lanes holds three per kind, the 32 step or sm kernel, wide and FP64.
+const char * lane_suffix[3] = { "", "_x2", "_x4" };
 
-				if(try_all_factors(k, n, c) == 0){	// check for a small prime factor of the number
+uint32_t sieveIndex( searchData & sd ){
 
-					// check the factor actually divides the number
-					if(verify_factor(p,k,n,c)){
-						++sd.factorcount;
-						if ( sprintf( buffer, "%" PRIu64 " | %u*2^%u%+d\n",p,k,n,c) < 0 ){
-							fprintf(stderr,"error in sprintf()\n");
-							exit(EXIT_FAILURE);
-						}	
-						strcat( resbuff, buffer );
-						// add the factor to checksum
-						sd.checksum += k;
-						sd.checksum += n;
-						(c == 1)?(++sd.checksum):(--sd.checksum);
-					}
-					else{
-						printf("ERROR: GPU calculated invalid factor!\n");
-						fprintf(stderr,"ERROR: GPU calculated invalid factor!\n");
-						exit(EXIT_FAILURE);
-					}
-				}
-			}
-			else{
-				uint64_t b = k/sd.kstep;
-
-				if(k == sd.kstep*b+sd.koffset) { // k is odd.
-
-					if(try_all_factors(k, n, c) == 0 ){  // check for a small prime factor of the number
-
-						// check the factor actually divides the number
-						if(verify_factor(p,k,n,c)){
-							++sd.factorcount;
-							if ( sprintf( buffer, "%" PRIu64 " | %u*2^%u%+d\n",p,k,n,c) < 0 ){
-								fprintf(stderr,"error in sprintf()\n");
-								exit(EXIT_FAILURE);
-							}	
-							strcat( resbuff, buffer );
-							// add the factor to checksum
-							sd.checksum += k;
-							sd.checksum += n;
-							(c == 1)?(++sd.checksum):(--sd.checksum);
-						}
-						else{
-							printf("ERROR: GPU calculated invalid factor!\n");
-							fprintf(stderr,"ERROR: GPU calculated invalid factor!\n");
-							exit(EXIT_FAILURE);
-						}
-					}
-				}
-			}
+	return ((sd.lanes == 4) ? 2 : (sd.lanes == 2) ? 1 : 0) + 3 * sd.kind;
+}
 
-		}
 
-		report_solution( resbuff );
 
-		free(h_factorP);
-		free(h_factorKN);
-		free(resbuff);
-	}
+// primewrite's extra args when it's built with FUSED_SETUP.  same as setup's args 1 to 9
+void setFusedArgs( progData & pd, searchData & sd, cl_mem & d_Ps, cl_mem & d_K, cl_mem & d_lK ){
 
-	free(h_flag);
-	free(h_factorcount);
-	free(h_checksum);
-	free(h_primecount);
+	sclSoft gen = pd.primewrite;
+	int a = 5;
 
+	sclSetKernelArg(gen, a, sizeof(cl_mem), &d_Ps);
+	sclSetKernelArg(gen, a+1, sizeof(cl_mem), &d_K);
+	sclSetKernelArg(gen, a+2, sizeof(cl_mem), &d_lK);
+	sclSetKernelArg(gen, a+3, sizeof(uint64_t), &sd.r0);
+	sclSetKernelArg(gen, a+4, sizeof(int32_t), &sd.bbits);
+	sclSetKernelArg(gen, a+5, sizeof(uint32_t), &sd.nmin);
+	sclSetKernelArg(gen, a+6, sizeof(uint64_t), &sd.r1);
+	sclSetKernelArg(gen, a+7, sizeof(int32_t), &sd.bbits1);
+	sclSetKernelArg(gen, a+8, sizeof(uint32_t), &sd.lastN);
 }
 
 
+// point the prime generator, setup, sieve and check kernels at batch slot s.  all of a box's sieve
+// kernels when profiling, otherwise only the one in use.  the fused generator sets up box 0.
+void setSlotArgs( progData & pd, searchData & sd, uint32_t s, bool all ){
 
-// find the log base 2 of a number.
-int lg2(uint64_t v) {
+	sclSetKernelArg(pd.primescan, 2, sizeof(cl_mem), &pd.d_primecount[s]);
+	sclSetKernelArg(pd.primewrite, 4, sizeof(cl_mem), &pd.d_primes[s]);
 
-#ifdef __GNUC__
-	return 63-__builtin_clzll(v);
-#else
-	int r = 0; // r will be lg(v)
-	while (v >>= 1)r++;
-	return r;
-#endif
+	for(auto & bd : pd.box){
 
+		sclSetKernelArg(bd.setup, 0, sizeof(cl_mem), &pd.d_primes[s]);
+		sclSetKernelArg(bd.setup, 1, sizeof(cl_mem), &pd.d_Ps[s]);
+		sclSetKernelArg(bd.setup, 2, sizeof(cl_mem), &bd.d_K[s]);
+		sclSetKernelArg(bd.setup, 3, sizeof(cl_mem), &bd.d_lK[s]);
+		sclSetKernelArg(bd.setup, 10, sizeof(cl_mem), &pd.d_primecount[s]);
+
+		for(uint32_t v = 0; v < 9; ++v){
+			if(!hasSieve(bd, v) || (!all && bd.sieve_lanes[v].kernel != bd.sieve.kernel)) continue;
+			sclSoft & k = bd.sieve_lanes[v];
+			sclSetKernelArg(k, 0, sizeof(cl_mem), &pd.d_primes[s]);
+			sclSetKernelArg(k, 1, sizeof(cl_mem), &pd.d_Ps[s]);
+			sclSetKernelArg(k, 2, sizeof(cl_mem), &bd.d_K[s]);
+			sclSetKernelArg(k, 3, sizeof(cl_mem), &pd.d_primecount[s]);
+		}
+
+		sclSetKernelArg(bd.check, 0, sizeof(cl_mem), &bd.d_K[s]);
+		sclSetKernelArg(bd.check, 1, sizeof(cl_mem), &bd.d_lK[s]);
+		sclSetKernelArg(bd.check, 3, sizeof(cl_mem), &pd.d_primecount[s]);
+		sclSetKernelArg(bd.check, 4, sizeof(cl_mem), &pd.d_primes[s]);
+	}
+
+	if(sd.fused){
+		setFusedArgs(pd, sd, pd.d_Ps[s], pd.box[0].d_K[s], pd.box[0].d_lK[s]);
+	}
 }
 
 
-void setupSearch(searchData & sd){
+// commands enqueued on queue after this wait for everything enqueued on other so far
+void queueWait( cl_command_queue queue, cl_command_queue other ){
 
-	sd.p = sd.pmin;
+	cl_event marker;
 
-	if(sd.pmin == 0 || sd.pmax == 0){
-		printf("-p and -P arguments are required\n");
-		fprintf(stderr, "-p and -P arguments are required\n");
-		exit(EXIT_FAILURE);
+	cl_int err = clEnqueueMarker(other, &marker);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clEnqueueMarker\n");
+		fprintf(stderr, "ERROR: clEnqueueMarker\n");
+		sclPrintErrorFlags(err);
 	}
 
-	if(sd.nmin == 0 || sd.nmax == 0){
+	err = clFlush(other);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clFlush\n" );
+		fprintf(stderr, "ERROR: clFlush\n" );
+		sclPrintErrorFlags( err );
+	}
+
+	err = clEnqueueWaitForEvents(queue, 1, &marker);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clEnqueueWaitForEvents\n");
+		fprintf(stderr, "ERROR: clEnqueueWaitForEvents\n");
+		sclPrintErrorFlags(err);
+	}
+
+	clReleaseEvent(marker);
+}
+
+
+// allocate the prime generator's bitmap and work-group counts for batches of range numbers
+cl_mem allocGenBuffers( progData & pd, sclHard hardware, uint64_t range, cl_mem & d_gcount ){
+
+	cl_int err = 0;
+	uint32_t ngroups = genGroups(pd, range);
+	uint32_t nwords = ngroups * genWords(pd);
+
+	cl_mem d_bits = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, nwords*sizeof(cl_uint), NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+		printf( "ERROR: clCreateBuffer failure.\n" );
+		exit(EXIT_FAILURE);
+	}
+	d_gcount = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, (ngroups+1)*sizeof(cl_uint), NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+		printf( "ERROR: clCreateBuffer failure.\n" );
+		exit(EXIT_FAILURE);
+	}
+
+	if(pd.erato){
+		// primewrite clears the bits it reads, so this is only needed once
+		sclSetKernelArg(pd.segclear, 0, sizeof(cl_mem), &d_bits);
+		sclSetKernelArg(pd.segclear, 1, sizeof(uint32_t), &nwords);
+		sclSetGlobalSize( pd.segclear, nwords );
+		sclEnqueueKernel(hardware, pd.segclear);
+
+		sclSetKernelArg(pd.segmark, 5, sizeof(cl_mem), &d_bits);
+		sclSetKernelArg(pd.segsieve, 5, sizeof(cl_mem), &d_bits);
+		sclSetKernelArg(pd.segsieve, 6, sizeof(cl_mem), &d_gcount);
+	}
+	else{
+		sclSetKernelArg(pd.getsegprimes, 2, sizeof(cl_mem), &d_bits);
+		sclSetKernelArg(pd.getsegprimes, 3, sizeof(cl_mem), &d_gcount);
+	}
+
+	uint32_t gwords = genWords(pd);
+	sclSetKernelArg(pd.primescan, 0, sizeof(cl_mem), &d_gcount);
+	sclSetKernelArg(pd.primewrite, 1, sizeof(uint32_t), &gwords);
+	sclSetKernelArg(pd.primewrite, 2, sizeof(cl_mem), &d_bits);
+	sclSetKernelArg(pd.primewrite, 3, sizeof(cl_mem), &d_gcount);
+	setGenSize(pd, range);
+
+	return d_bits;
+}
+
+
+// enqueue the prime generator's count, scan and write passes for the batch set by setPrimeArgs.
+// returns the count pass's event, it's most of the time.
+cl_event enqueueGen( progData & pd, sclHard hardware, uint32_t nmark ){
+
+	if(nmark){
+		sclEnqueueKernel(hardware, pd.segmark);
+	}
+	cl_event event = sclEnqueueKernelEvent(hardware, (pd.erato) ? pd.segsieve : pd.getsegprimes);
+	sclEnqueueKernel(hardware, pd.primescan);
+	sclEnqueueKernel(hardware, pd.primewrite);
+
+	return event;
+}
+
+
+// factors of a multi-box run are kept in a file per box until reportChecksum writes the sections
+void results_name( searchData & sd, char * name, size_t size ){
+
+	if(sd.nbox > 1){
+		snprintf(name, size, BOX_FILENAME, sd.box);
+	}
+	else{
+		snprintf(name, size, "%s", RESULTS_FILENAME);
+	}
+
+}
+
+
+void report_solution( searchData & sd, char * results ){
+
+	char name[64];
+	results_name(sd, name, sizeof(name));
+
+	FILE * resfile = my_fopen(name,"a");
+
+	if( resfile == NULL ){
+		fprintf(stderr,"Cannot open %s !!!\n",name);
+		exit(EXIT_FAILURE);
+	}
+
+	if( fprintf( resfile, "%s", results ) < 0 ){
+		fprintf(stderr,"Cannot write to %s !!!\n",name);
+		exit(EXIT_FAILURE);
+	}
+
+	fclose(resfile);
+
+}
+
+
+// sort factors by prime.  equal primes keep the order they were found in.
+void sortFactors( uint32_t factorcount, int64_t * factorP, cl_uint2 * factorKN ){
+
+	if(factorcount < 2){
+		return;
+	}
+
+	// sort an index by prime size, then move the factors into place
+	vector<uint32_t> order(factorcount);
+	for(uint32_t i = 0; i < factorcount; ++i){
+		order[i] = i;
+	}
+
+	stable_sort(order.begin(), order.end(), [factorP](uint32_t x, uint32_t y){
+		uint64_t a = (factorP[x]<0)?-factorP[x]:factorP[x];
+		uint64_t b = (factorP[y]<0)?-factorP[y]:factorP[y];
+		return a < b;
+	});
+
+	vector<int64_t> sortedP(factorcount);
+	vector<cl_uint2> sortedKN(factorcount);
+	for(uint32_t i = 0; i < factorcount; ++i){
+		sortedP[i] = factorP[order[i]];
+		sortedKN[i] = factorKN[order[i]];
+	}
+
+	memcpy(factorP, sortedP.data(), factorcount * sizeof(int64_t));
+	memcpy(factorKN, sortedKN.data(), factorcount * sizeof(cl_uint2));
+
+}
+
+
+// check a factor for small prime divisors and validity on the CPU.  1 if it's reported, 0 if the number has
+// a small prime divisor or k isn't in the search, -1 if it doesn't divide the number.  safe to call from any thread.
+int8_t checkFactor( const searchData & sd, int64_t sp, cl_uint2 kn ){
+
+	// use the sign bit of P for the sign of the factor since its limited to 2^62
+	uint64_t p = (sp < 0)?-sp:sp;
+	uint32_t k = kn.s0;
+	uint32_t n = kn.s1;
+	int32_t c = (sp < 0)?-1:1;
+
+	if(!sd.cw){
+		uint64_t b = k/sd.kstep;
+
+		if(k != sd.kstep*b+sd.koffset) { // k is even.
+			return 0;
+		}
+	}
+
+	if(try_all_factors(k, n, c) != 0){	// check for a small prime factor of the number
+		return 0;
+	}
+
+	// check the factor actually divides the number
+	return verify_factor(p,k,n,c) ? 1 : -1;
+}
+
+
+// report the checked factors to the results file in order, and add them to the checksum
+void reportFactors( searchData & sd, uint32_t factorcount, int64_t * factorP, cl_uint2 * factorKN, int8_t * verdict ){
+
+	char * resbuff = (char *)malloc( factorcount * sizeof(char) * 256 + 1 );
+	if( resbuff == NULL ){
+		fprintf(stderr,"malloc error\n");
+		exit(EXIT_FAILURE);
+
+	}
+	resbuff[0] = '\0';
+	char * end = resbuff;
+
+	for(uint32_t m=0; m<factorcount; ++m){
+
+		if(verdict[m] < 0){
+			printf("ERROR: GPU calculated invalid factor!\n");
+			fprintf(stderr,"ERROR: GPU calculated invalid factor!\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if(verdict[m] == 0){
+			continue;
+		}
+
+		int64_t sp = factorP[m];
+		uint64_t p = (sp < 0)?-sp:sp;
+		uint32_t k = factorKN[m].s0;
+		uint32_t n = factorKN[m].s1;
+		int32_t c = (sp < 0)?-1:1;
+
+		++sd.factorcount;
+		int len = sprintf( end, "%" PRIu64 " | %u*2^%u%+d\n",p,k,n,c);
+		if ( len < 0 ){
+			fprintf(stderr,"error in sprintf()\n");
+			exit(EXIT_FAILURE);
+		}	
+		end += len;
+		// add the factor to checksum
+		sd.checksum += k;
+		sd.checksum += n;
+		(c == 1)?(++sd.checksum):(--sd.checksum);
+
+	}
+
+	report_solution( sd, resbuff );
+
+	free(resbuff);
+
+}
+
+
+// sort factors by prime, check them for small prime divisors and validity on the CPU,
+// then report them to the results file and add them to the checksum
+void processFactors( searchData & sd, uint32_t factorcount, int64_t * factorP, cl_uint2 * factorKN ){
+
+	sortFactors(factorcount, factorP, factorKN);
+
+	vector<int8_t> verdict(factorcount);
+	for(uint32_t m=0; m<factorcount; ++m){
+		verdict[m] = checkFactor(sd, factorP[m], factorKN[m]);
+	}
+
+	reportFactors(sd, factorcount, factorP, factorKN, verdict.data());
+
+}
+
+
+// scale factor toward the target kernel time.  a 10% dead band and small steps keep it from hunting.
+double retuneStep( double ms, double target ){
+
+	if(ms <= 0.0 || (ms > 0.9 * target && ms < 1.1 * target)){
+		return 1.0;
+	}
+
+	double f = target / ms;
+	if(f > 1.25) f = 1.25;
+	if(f < 0.8) f = 0.8;
+
+	return f;
+}
+
+
+// feedback tuning, once per batch.  the last batch's prime generator launch sets the batch range
+// and each box's first sieve launch sets its kernel_nstep.  a launch that hasn't finished is skipped.
+// the range is bounded by the prime array, psize, at the prime density of p.
+void retune( progData & pd, vector<searchData> & box, uint64_t p, int debuginfo ){
+
+	searchData & sd = box[0];
+
+	if(pd.gen_event != NULL){
+		double f = (eventDone(pd.gen_event)) ? retuneStep(sclEventTime(pd.gen_event), sd.ktime) : 1.0;
+		clReleaseEvent(pd.gen_event);
+		pd.gen_event = NULL;
+
+		if(f != 1.0){
+			uint64_t maxrange = (uint64_t)( (double)pd.psize / 1.25 * log((double)p) );
+			if(maxrange > pd.maxrange) maxrange = pd.maxrange;
+
+			uint64_t range = (uint64_t)( (double)pd.range * f );
+			if(range > maxrange) range = maxrange;
+			if(range < 1000000) range = 1000000;
+
+			if(range != pd.range){
+				pd.range = (uint32_t)range;
+				setGenSize(pd, pd.range);
+				if(debuginfo) printf("retune: range %u\n", pd.range);
+			}
+		}
+	}
+
+	for(uint32_t b = 0; b < sd.nbox; ++b){
+
+		searchData & bs = box[b];
+		boxData & bd = pd.box[b];
+
+		if(bd.sieve_event == NULL) continue;
+
+		double f = (eventDone(bd.sieve_event)) ? retuneStep(sclEventTime(bd.sieve_event), sd.ktime) : 1.0;
+		clReleaseEvent(bd.sieve_event);
+		bd.sieve_event = NULL;
+
+		// persistent mode always sieves all of N in one launch
+		if(f == 1.0 || sd.compute) continue;
+
+		uint32_t maxnstep = persistentNstep(bs);
+		uint64_t knstep = (uint64_t)( (double)bs.kernel_nstep * f );
+		knstep = (knstep / bs.nstep) * bs.nstep;
+		if(knstep > maxnstep) knstep = maxnstep;
+		if(knstep < bs.nstep) knstep = bs.nstep;
+
+		if(knstep != bs.kernel_nstep){
+			bs.kernel_nstep = (uint32_t)knstep;
+			for(uint32_t v = 0; v < 9; ++v){
+				if(hasSieve(bd, v)) sclSetKernelArg(bd.sieve_lanes[v], 9, sizeof(uint32_t), &bs.kernel_nstep);
+			}
+			if(debuginfo) printf("retune: box %u kernel_nstep %u\n", b, bs.kernel_nstep);
+		}
+	}
+}
+
+
+// expected factors from one batch of primes, before goodfactor.  each odd k and each n has
+// about a 1 in p chance per sign, and a batch holds about range / log(p) primes.
+// the buffer holds several batches at the lowest p, so the count can be checked once per batch.
+uint32_t factorBufferSize( searchData & sd, uint32_t range ){
+
+	double nk = (sd.cw) ? 1.0 : (double)((sd.kmax - sd.kmin) / 2 + 1);
+	double nn = (double)(sd.nmax - sd.nmin + 1);
+	double p = (double)sd.pmin;
+	double batch = 2.0 * nk * nn * (double)range / (p * log(p));
+
+	uint32_t size = 16384;
+	while(size < 8.0 * batch && size < 1048576){
+		size <<= 1;
+	}
+
+	return size;
+}
+
+
+// point a box's sieve and check kernels at the result slot in use
+void setResultArgs( progData & pd, boxData & bd ){
+
+	uint32_t r = pd.rslot;
+
+	for(uint32_t v = 0; v < 9; ++v){
+		if(!hasSieve(bd, v)) continue;
+		sclSetKernelArg(bd.sieve_lanes[v], 4, sizeof(cl_mem), &bd.d_factorKN[r]);
+		sclSetKernelArg(bd.sieve_lanes[v], 5, sizeof(cl_mem), &bd.d_factorP[r]);
+		sclSetKernelArg(bd.sieve_lanes[v], 6, sizeof(cl_mem), &bd.d_ctl[r]);
+		sclSetKernelArg(bd.sieve_lanes[v], 15, sizeof(uint32_t), &bd.maxfactors);
+	}
+
+	sclSetKernelArg(bd.check, 2, sizeof(cl_mem), &bd.d_ctl[r]);
+}
+
+
+// (re)allocate both slots of a box's factor arrays and their pinned host copy, and point its sieve kernels at them
+void allocFactors( progData & pd, boxData & bd, sclHard hardware, uint32_t size ){
+
+	cl_int err = 0;
+
+	for(uint32_t r = 0; r < 2; ++r){
+
+		sclReleaseMemObject(bd.d_factorP[r]);
+		sclReleaseMemObject(bd.d_factorKN[r]);
+
+		bd.d_factorP[r] = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, (size_t)size*sizeof(cl_long), NULL, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+			printf( "ERROR: clCreateBuffer failure.\n" );
+			exit(EXIT_FAILURE);
+		}
+		bd.d_factorKN[r] = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, (size_t)size*sizeof(cl_uint2), NULL, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+			printf( "ERROR: clCreateBuffer failure.\n" );
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sclFreePinned(hardware, bd.p_factorP, bd.h_factorP);
+	sclFreePinned(hardware, bd.p_factorKN, bd.h_factorKN);
+	bd.p_factorP = sclMallocPinned(hardware, (size_t)size*sizeof(cl_long), (void **)&bd.h_factorP);
+	bd.p_factorKN = sclMallocPinned(hardware, (size_t)size*sizeof(cl_uint2), (void **)&bd.h_factorKN);
+
+	bd.maxfactors = size;
+
+	setResultArgs(pd, bd);
+}
+
+
+// bytes in a control block, the header and numgroups checksums
+size_t ctlSize( progData & pd ){
+
+	return CTL_HEADER*sizeof(cl_uint) + pd.numgroups*sizeof(cl_ulong);
+}
+
+
+// allocate the control blocks of both result slots of a box, and their pinned copies
+void allocResults( progData & pd, boxData & bd, sclHard hardware ){
+
+	cl_int err = 0;
+
+	for(uint32_t r = 0; r < 2; ++r){
+		bd.d_ctl[r] = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, ctlSize(pd), NULL, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+			printf( "ERROR: clCreateBuffer failure.\n" );
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bd.p_ctl = sclMallocPinned(hardware, ctlSize(pd), (void **)&bd.h_ctl);
+	bd.p_head = sclMallocPinned(hardware, 2*CTL_HEADER*sizeof(cl_uint), (void **)&bd.h_head);
+	memset(bd.h_head, 0, 2*CTL_HEADER*sizeof(cl_uint));
+}
+
+
+// control block header of a box, read after the batch before last.  that read is done, the end of
+// that batch was waited on before the last batch was queued.
+uint32_t * batchHeader( boxData & bd, uint64_t batch ){
+
+	return bd.h_head + (batch & 1) * CTL_HEADER;
+}
+
+
+// false if that header is still of the slot being read, up to two batches after startRead.
+// collectResults checks that slot's whole control block.
+bool headerCurrent( progData & pd, uint64_t batch ){
+
+	return batch >= pd.head_batch + 2;
+}
+
+
+// true if a box's factor count, read after the batch before last, passed half its buffer.
+bool factorsFilling( progData & pd, uint64_t batch ){
+
+	if(!headerCurrent(pd, batch)){
+		return false;
+	}
+
+	for(auto & bd : pd.box){
+		if(batchHeader(bd, batch)[CTL_FACTORS] > bd.maxfactors / 2){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// a box's factors overflowed its buffer.  grow it to twice the count, so the next pass has room to spare
+void growFactors( progData & pd, boxData & bd, sclHard hardware, uint32_t factorcount ){
+
+	uint32_t size = bd.maxfactors;
+	while(size / 2 < factorcount && size < (1u << 31)) size <<= 1;
+
+	fprintf(stderr,"%u factors overflowed the %u factor buffer, growing it to %u and resuming from the last checkpoint.\n",
+		factorcount, bd.maxfactors, size);
+
+	allocFactors(pd, bd, hardware, size);
+}
+
+
+// clear result slot r of each box
+void clearResultSlot( progData & pd, sclHard hardware, uint32_t r ){
+
+	for(auto & bd : pd.box){
+		sclSetKernelArg(bd.clearresult, 0, sizeof(cl_mem), &bd.d_ctl[r]);
+		sclEnqueueKernel(hardware, bd.clearresult);
+	}
+}
+
+
+// drop the results since the last checkpoint, after growing a factor buffer.  the queue was drained.
+void resetResults( progData & pd, sclHard hardware ){
+
+	clearResultSlot(pd, hardware, 0);
+	clearResultSlot(pd, hardware, 1);
+
+	for(auto & bd : pd.box){
+		memset(bd.h_head, 0, 2*CTL_HEADER*sizeof(cl_uint));
+	}
+
+	pd.rstate = 0;
+}
+
+
+// swap result slots and queue a non-blocking read of the control block of the one the kernels were
+// writing.  the reads land once the batches queued so far are done, up to p.  nothing waits here.
+// batch is the first batch to write the other slot.
+void startRead( progData & pd, sclHard hardware, uint64_t p, uint64_t batch ){
+
+	uint32_t r = pd.rslot;
+
+	pd.rslot ^= 1;
+	pd.head_batch = batch;
+
+	for(auto & bd : pd.box){
+		setResultArgs(pd, bd);
+
+		sclReadNonBlocking(hardware, ctlSize(pd), bd.d_ctl[r], bd.h_ctl);
+	}
+
+	cl_int err = clEnqueueMarker(hardware.queue, &pd.read_event);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clEnqueueMarker\n");
+		fprintf(stderr, "ERROR: clEnqueueMarker\n");
+		sclPrintErrorFlags(err);
+	}
+
+	err = clFlush(hardware.queue);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clFlush\n" );
+		fprintf(stderr, "ERROR: clFlush\n" );
+		sclPrintErrorFlags( err );
+	}
+
+	pd.read_p = p;
+	pd.rstate = 1;
+}
+
+
+// errors the check kernel records in a control block header
+void checkHeader( progData & pd, uint32_t * ctl ){
+
+	// flag set by gpu if there is an internal checksum error
+	if(ctl[CTL_FLAG] > 0){
+		fprintf(stderr,"error: gpu checksum failure\n");
+		printf("error: gpu checksum failure\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// largest kernel prime count.  used to check array bounds
+	if(ctl[CTL_MAXPRIMES] > pd.psize){
+		fprintf(stderr,"error: gpu prime array overflow\n");
+		printf("error: gpu prime array overflow\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+// move the read started by startRead along.  without wait it returns while a queued read or the verification
+// isn't done.  once the factors are in they're verified by the verify pool, while the GPU keeps sieving.  then
+// they're added to the results at the last checkpoint, ckpt, in order, which is checkpointed at read_p and the
+// slot is cleared for reuse.  the prime count is shared, box 0 keeps it.
+// returns false if a box found more factors than its buffer holds.  the queue is drained, that buffer is
+// grown and the caller has to search again from ckpt.
+bool collectResults( progData & pd, searchData * ckpt, sclHard hardware, bool wait ){
+
+	uint32_t nbox = ckpt[0].nbox;
+	uint32_t r = pd.rslot ^ 1;
+
+	if(pd.rstate == 0){
+		return true;
+	}
+
+	if(pd.rstate < 3){
+		if(!wait && !eventDone(pd.read_event)){
+			return true;
+		}
+
+		waitOnEvent(hardware, pd.read_event);
+		pd.read_event = NULL;
+	}
+
+	if(pd.rstate == 1){
+
+		for(auto & bd : pd.box){
+			checkHeader(pd, bd.h_ctl);
+		}
+
+		bool overflow = false;
+		for(auto & bd : pd.box){
+			if(bd.h_ctl[CTL_FACTORS] > bd.maxfactors){
+				if(!overflow){
+					// the batches after read_p are thrown away too
+					sleepCPU(hardware);
+					overflow = true;
+				}
+				growFactors(pd, bd, hardware, bd.h_ctl[CTL_FACTORS]);
+			}
+		}
+
+		if(overflow){
+			resetResults(pd, hardware);
+			return false;
+		}
+
+		// copy factors to pinned host memory
+		for(auto & bd : pd.box){
+			uint32_t factorcount = bd.h_ctl[CTL_FACTORS];
+			if(factorcount > 0){
+				sclReadNonBlocking(hardware, factorcount * sizeof(int64_t), bd.d_factorP[r], bd.h_factorP);
+				sclReadNonBlocking(hardware, factorcount * sizeof(cl_uint2), bd.d_factorKN[r], bd.h_factorKN);
+			}
+		}
+
+		cl_int err = clEnqueueMarker(hardware.queue, &pd.read_event);
+		if ( err != CL_SUCCESS ) {
+			printf( "ERROR: clEnqueueMarker\n");
+			fprintf(stderr, "ERROR: clEnqueueMarker\n");
+			sclPrintErrorFlags(err);
+		}
+
+		pd.rstate = 2;
+
+		if(!wait && !eventDone(pd.read_event)){
+			return true;
+		}
+
+		waitOnEvent(hardware, pd.read_event);
+		pd.read_event = NULL;
+	}
+
+	if(pd.rstate == 2){
+
+		// sorted here, so the verdicts line up with the factors as they're reported
+		uint32_t total = 0;
+		vector<uint32_t> first(nbox + 1);
+		for(uint32_t b = 0; b < nbox; ++b){
+			boxData & bd = pd.box[b];
+			uint32_t factorcount = bd.h_ctl[CTL_FACTORS];
+			sortFactors(factorcount, bd.h_factorP, bd.h_factorKN);
+			bd.verdict.assign(factorcount, 0);
+			first[b] = total;
+			total += factorcount;
+		}
+		first[nbox] = total;
+
+		if(total > 0){
+			pd.verify->start(total, [&pd, ckpt, first](uint32_t i, uint32_t){
+				uint32_t b = 0;
+				while(i >= first[b+1]) ++b;
+				boxData & bd = pd.box[b];
+				uint32_t m = i - first[b];
+				bd.verdict[m] = checkFactor(ckpt[b], bd.h_factorP[m], bd.h_factorKN[m]);
+			});
+		}
+
+		pd.rstate = 3;
+	}
+
+	if(!wait && !pd.verify->finished()){
+		return true;
+	}
+
+	pd.verify->wait();
+
+	boinc_begin_critical_section();
+
+	for(uint32_t b = 0; b < nbox; ++b){
+
+		searchData & sd = ckpt[b];
+		boxData & bd = pd.box[b];
+
+		uint64_t * checksum = (uint64_t *)(bd.h_ctl + CTL_HEADER);
+
+		// index 0 is the gpu's total prime count, every box's check kernel counts the same primes
+		if(b == 0){
+			sd.primecount += checksum[0];
+		}
+
+		// sum block checksums
+		for(uint32_t i=1; i<pd.numgroups; ++i){
+			sd.checksum += checksum[i];
+		}
+
+		if(bd.h_ctl[CTL_FACTORS] > 0){
+			reportFactors(sd, bd.h_ctl[CTL_FACTORS], bd.h_factorP, bd.h_factorKN, bd.verdict.data());
+		}
+	}
+
+	ckpt[0].p = pd.read_p;
+	checkpoint(ckpt);
+
+	boinc_end_critical_section();
+
+	clearResultSlot(pd, hardware, r);
+	pd.rstate = 0;
+
+	return true;
+}
+
+
+// check the control block headers read after the batch before last, unless they're of the slot being
+// read.  the host only clears them with the queue drained, a read may still be landing in the other copy.
+// returns false if a box's factors overflowed its buffer.  the results of an earlier read are collected
+// first, then the queue is drained, that buffer is grown and the caller has to search again from ckpt.
+bool batchFits( progData & pd, searchData * ckpt, sclHard hardware, uint64_t batch, bool debuginfo ){
+
+	if(!headerCurrent(pd, batch)){
+		return true;
+	}
+
+	bool overflow = false;
+
+	for(uint32_t b = 0; b < pd.box.size(); ++b){
+
+		uint32_t * head = batchHeader(pd.box[b], batch);
+
+		checkHeader(pd, head);
+
+		if(debuginfo && head[CTL_BATCHES] > 0){
+			printf("box %u batch %u: %u primes, %u factors\n", b, head[CTL_BATCHES], head[CTL_BATCH_PRIMES], head[CTL_BATCH_FACTORS]);
+		}
+
+		if(head[CTL_FACTORS] > pd.box[b].maxfactors){
+			overflow = true;
+		}
+	}
+
+	if(!overflow){
+		return true;
+	}
+
+	if(!collectResults(pd, ckpt, hardware, true)){
+		return false;
+	}
+
+	sleepCPU(hardware);
+
+	for(auto & bd : pd.box){
+		uint32_t factorcount = batchHeader(bd, batch)[CTL_FACTORS];
+		if(factorcount > bd.maxfactors){
+			growFactors(pd, bd, hardware, factorcount);
+		}
+	}
+
+	resetResults(pd, hardware);
+
+	return false;
+}
+
+
+
+// find the log base 2 of a number.
+int lg2(uint64_t v) {
+
+#ifdef __GNUC__
+	return 63-__builtin_clzll(v);
+#else
+	int r = 0; // r will be lg(v)
+	while (v >>= 1)r++;
+	return r;
+#endif
+
+}
+
+
+// p < 2^50 and double precision with fma, where the FP64 sieve is exact.  the OpenCL device's, or the CPU's for the CPU engine.
+bool fp64Range( searchData & sd ){
+
+	return sd.fp64 && sd.pmax < (((uint64_t)1) << 50);
+}
+
+
+// -S 4, the FP64 sieve in fp64Range without timing it against the others.  for testing the FP64 kernels.
+bool fp64Forced( searchData & sd ){
+
+	return sd.simd == 4 && fp64Range(sd);
+}
+
+
+void setupSearch(searchData & sd){
+
+	sd.p = sd.pmin;
+
+	if(sd.pmin == 0 || sd.pmax == 0){
+		printf("-p and -P arguments are required\n");
+		fprintf(stderr, "-p and -P arguments are required\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(sd.nmin == 0 || sd.nmax == 0){
 		printf("-n and -N arguments are required\n");
 		fprintf(stderr, "-n and -N arguments are required\n");
 		exit(EXIT_FAILURE);
@@ -774,8 +1739,11 @@ void setupSearch(searchData & sd){
 	// For TPS, decrease the ld_nstep by one to allow overlap, checking both + and -
 	sd.nstep--;
 
-	// Use the 32-step algorithm where useful.
-	if(sd.nstep >= 32 && (((uint64_t)1) << 32) <= sd.pmin) {
+	// Use the 32-step algorithm where useful.  A wider step is kept for the wide kernels, they stop on
+	// the 32 step grid too, so lastN and the checksum don't depend on which kernel the profiler picks.
+	sd.wstep = 0;
+	if(sd.nstep > 32) {
+		sd.wstep = sd.nstep;
 		sd.nstep = 32;
 	}
 
@@ -830,11 +1798,212 @@ void setupSearch(searchData & sd){
 
 
 
-void profileGPU(progData & pd, searchData sd, sclHard hardware, int debuginfo ){
+// the search boxes of a run: sd alone, or one per line of the --boxes file, all with sd's p range.
+// a line is "kmin kmax nmin nmax" for a Proth box or "c nmin nmax" for Cullen/Woodall, # starts a comment.
+vector<searchData> readBoxes( searchData & sd ){
 
-	// calculate approximate chunk size based on gpu's compute units
-	cl_int err = 0;
+	vector<searchData> box;
+
+	if(sd.boxfile == NULL){
+		box.push_back(sd);
+		setupSearch(box[0]);
+		return box;
+	}
+
+	FILE * in = fopen(sd.boxfile, "r");
+	if(in == NULL){
+		fprintf(stderr,"Cannot open %s !!!\n",sd.boxfile);
+		printf("Cannot open %s !!!\n",sd.boxfile);
+		exit(EXIT_FAILURE);
+	}
+
+	char line[256];
+
+	while(fgets(line, sizeof(line), in) != NULL){
+
+		char * c = line + strspn(line, " \t");
+		if(*c == '#' || *c == '\n' || *c == '\r' || *c == '\0') continue;
+
+		searchData b = sd;
+		int fields = 0;
+
+		if(*c == 'c'){
+			b.cw = true;
+			b.kmin = b.kmax = 0;
+			fields = (sscanf(c+1, "%u %u", &b.nmin, &b.nmax) == 2) ? 4 : 0;
+		}
+		else{
+			b.cw = false;
+			fields = sscanf(c, "%u %u %u %u", &b.kmin, &b.kmax, &b.nmin, &b.nmax);
+		}
+
+		// same limits as -k -K -n -N
+		if(fields != 4 || b.nmin < 65 || b.nmax >= (1U<<31) || (!b.cw && (b.kmin < 1 || b.kmax >= (1U<<31)))){
+			fprintf(stderr,"Invalid search box in %s: %s",sd.boxfile,line);
+			printf("Invalid search box in %s: %s",sd.boxfile,line);
+			exit(EXIT_FAILURE);
+		}
+
+		b.box = (uint32_t)box.size();
+		box.push_back(b);
+	}
+
+	fclose(in);
+
+	if(box.size() == 0){
+		fprintf(stderr,"No search boxes in %s\n",sd.boxfile);
+		printf("No search boxes in %s\n",sd.boxfile);
+		exit(EXIT_FAILURE);
+	}
+
+	// the checkpoint covers every box
+	uint64_t workunit = 0;
+
+	for(auto & b : box){
+		b.nbox = (uint32_t)box.size();
+		setupSearch(b);
+		workunit += b.workunit;
+	}
+	for(auto & b : box){
+		b.workunit = workunit;
+	}
+
+	return box;
+}
+
+
+// clear the results file of each box
+static void clearResults( searchData * box ){
+
+	char name[64];
+
+	for(uint32_t b = 0; b < box[0].nbox; ++b){
+		results_name(box[b], name, sizeof(name));
+		FILE * temp_file = my_fopen(name,"w");
+		if (temp_file == NULL){
+			fprintf(stderr,"Cannot open %s !!!\n",name);
+			exit(EXIT_FAILURE);
+		}
+		fclose(temp_file);
+	}
+
+}
+
+
+// resume from a checkpoint if there is one, otherwise start new results files
+void loadState( searchData * box ){
+
+	searchData & sd = box[0];
+
+	if( sd.test ){
+		clearResults( box );
+	}
+	else{
+		// Resume from checkpoint if there is one
+		if( read_state( box ) ){
+			if(boinc_is_standalone()){
+				printf("Resuming search from checkpoint. Current p: %" PRIu64 "\n", sd.p);
+			}
+			fprintf(stderr,"Resuming search from checkpoint. Current p: %" PRIu64 "\n", sd.p);
+
+			//trying to resume a finished workunit
+			if( sd.p == sd.pmax ){
+				if(boinc_is_standalone()){
+					printf("Workunit complete.\n");
+				}
+				fprintf(stderr,"Workunit complete.\n");
+				boinc_finish(EXIT_SUCCESS);
+			}
+		}
+		// starting from beginning
+		else{
+			clearResults( box );
+
+			// setup boinc trickle up
+			sd.last_trickle = (uint64_t)time(NULL);
+		}
+	}
+
+}
+
+
+// the checksum lines of one box
+static void checksum_text( searchData & sd, char * buffer ){
+
+	if(sd.factorcount == 0){
+		if( sprintf( buffer, "no factors\n%016" PRIX64 "\n", sd.checksum ) < 0 ){
+			fprintf(stderr,"error in sprintf()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else{
+		if( sprintf( buffer, "%016" PRIX64 "\n", sd.checksum ) < 0 ){
+			fprintf(stderr,"error in sprintf()\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+}
+
+
+// write the final checksum to the results file.  a multi-box run gets a section per box,
+// the box, its factors, then its checksum.
+void reportChecksum( searchData * box ){
+
+	char buffer[256];
+
+	if(box[0].nbox == 1){
+		checksum_text( box[0], buffer );
+		report_solution( box[0], buffer );
+		return;
+	}
+
+	FILE * out = my_fopen(RESULTS_FILENAME,"w");
+	if (out == NULL){
+		fprintf(stderr,"Cannot open %s !!!\n",RESULTS_FILENAME);
+		exit(EXIT_FAILURE);
+	}
 
+	for(uint32_t b = 0; b < box[0].nbox; ++b){
+
+		searchData & sd = box[b];
+		char name[64];
+
+		if(sd.cw){
+			fprintf(out, "box %u: -c -n %u -N %u\n", b, sd.nmin+1, sd.nmax);
+		}
+		else{
+			fprintf(out, "box %u: -k %u -K %u -n %u -N %u\n", b, sd.kmin, sd.kmax, sd.nmin+1, sd.nmax);
+		}
+
+		results_name(sd, name, sizeof(name));
+		FILE * in = my_fopen(name,"r");
+		if (in == NULL){
+			fprintf(stderr,"Cannot open %s !!!\n",name);
+			exit(EXIT_FAILURE);
+		}
+		size_t len;
+		while( (len = fread(buffer, 1, sizeof(buffer), in)) > 0 ){
+			fwrite(buffer, 1, len, out);
+		}
+		fclose(in);
+
+		checksum_text( sd, buffer );
+		if( fprintf( out, "%s", buffer ) < 0 ){
+			fprintf(stderr,"Cannot write to %s !!!\n",RESULTS_FILENAME);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fclose(out);
+
+}
+
+
+// host side of the profile, doesn't need the kernels
+void profileRange(progData & pd, searchData sd){
+
+	// calculate approximate chunk size based on gpu's compute units
 	uint64_t calc_range = sd.computeunits * 750000;
 
 	// limit kernel global size
@@ -842,8 +2011,6 @@ void profileGPU(progData & pd, searchData sd, sclHard hardware, int debuginfo ){
 		calc_range = 4294900000;
 	}
 
-	uint64_t estimated = calc_range;
-
 	uint64_t prof_start = sd.p;
 
 	// don't profile at very low N
@@ -851,15 +2018,29 @@ void profileGPU(progData & pd, searchData sd, sclHard hardware, int debuginfo ){
 		prof_start = 100000000;
 	}
 
-	uint64_t prof_stop = prof_start + calc_range;
-
-	sclSetGlobalSize( pd.getsegprimes, (calc_range/60)+1 );
+	pd.prof_start = prof_start;
+	pd.prof_range = calc_range;
 
 	// get a count of primes in the gpu worksize
-	uint64_t prof_range_primes = primesieve_count_primes( prof_start, prof_stop );
+	pd.prof_range_primes = primesieve_count_primes( prof_start, prof_start + calc_range );
+
+}
+
+
+void profileGPU(progData & pd, searchData sd, sclHard hardware, int debuginfo ){
+
+	cl_int err = 0;
+
+	uint64_t calc_range = pd.prof_range;
+
+	uint64_t estimated = calc_range;
+
+	uint64_t prof_start = pd.prof_start;
+
+	uint64_t prof_stop = prof_start + calc_range;
 
 	// calculate prime array size based on result
-	uint64_t prof_mem_size = (uint64_t)(1.5 * (double)prof_range_primes);
+	uint64_t prof_mem_size = (uint64_t)(1.5 * (double)pd.prof_range_primes);
 
 	// kernels use uint for global id
 	if(prof_mem_size > UINT32_MAX){
@@ -869,38 +2050,52 @@ void profileGPU(progData & pd, searchData sd, sclHard hardware, int debuginfo ){
 	}
 
 	// allocate temporary gpu prime array for profiling
-	cl_mem d_profileprime = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, prof_mem_size*sizeof(uint64_t), NULL, &err );
+	cl_mem d_profileprime = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, prof_mem_size*sizeof(cl_uint), NULL, &err );
 	if ( err != CL_SUCCESS ) {
 		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
 	        printf( "ERROR: clCreateBuffer failure.\n" );
 		exit(EXIT_FAILURE);
 	}
 
-	int32_t prof_wheelidx;
-	uint64_t prof_kernel_start = prof_start;
+	cl_mem d_profgcount = NULL;
+	cl_mem d_profPs = NULL, d_profK = NULL, d_proflK = NULL;
 
-	findWheelOffset(prof_kernel_start, prof_wheelidx);
+	// the fused generator writes Ps, K and lK too
+	if(sd.fused){
+		d_profPs = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, prof_mem_size*sizeof(cl_ulong), NULL, &err );
+		d_profK = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, prof_mem_size*sizeof(cl_ulong), NULL, &err );
+		d_proflK = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, prof_mem_size*sizeof(cl_ulong), NULL, &err );
+		if ( d_profPs == NULL || d_profK == NULL || d_proflK == NULL ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+			printf( "ERROR: clCreateBuffer failure.\n" );
+			exit(EXIT_FAILURE);
+		}
+		setFusedArgs(pd, sd, d_profPs, d_profK, d_proflK);
+	}
 
 	// set static args
-	sclSetKernelArg(pd.getsegprimes, 0, sizeof(uint64_t), &prof_kernel_start);
-	sclSetKernelArg(pd.getsegprimes, 1, sizeof(uint64_t), &prof_stop);
-	sclSetKernelArg(pd.getsegprimes, 2, sizeof(int32_t), &prof_wheelidx);
-	sclSetKernelArg(pd.getsegprimes, 3, sizeof(cl_mem), &d_profileprime);
-	sclSetKernelArg(pd.getsegprimes, 4, sizeof(cl_mem), &pd.d_primecount);
+	cl_mem d_profbits = allocGenBuffers(pd, hardware, calc_range, d_profgcount);
+	sclSetKernelArg(pd.primescan, 2, sizeof(cl_mem), &pd.d_primecount[0]);
+	sclSetKernelArg(pd.primewrite, 4, sizeof(cl_mem), &d_profileprime);
 
-	// zero prime count
-	sclEnqueueKernel(hardware, pd.clearn);
+	uint32_t nmark = setPrimeArgs(pd, prof_start, prof_stop);
 
-	// Benchmark the GPU
-	double kernel_ms = ProfilesclEnqueueKernel(hardware, pd.getsegprimes);
+	// Benchmark the GPU, all passes of the prime generator
+	double kernel_ms = 0.0;
+	if(nmark){
+		kernel_ms += ProfilesclEnqueueKernel(hardware, pd.segmark);
+	}
+	kernel_ms += ProfilesclEnqueueKernel(hardware, (pd.erato) ? pd.segsieve : pd.getsegprimes);
+	kernel_ms += ProfilesclEnqueueKernel(hardware, pd.primescan);
+	kernel_ms += ProfilesclEnqueueKernel(hardware, pd.primewrite);
 
-	// target is 10ms for prime generator kernel
-	double prof_multi = 10.0 / kernel_ms;
+	// target kernel time for the prime generator
+	double prof_multi = (double)sd.ktime / kernel_ms;
 
 	// update chunk size based on the profile
 	calc_range = (uint64_t)( (double)calc_range * prof_multi );
 
-	// limit kernel global size
+	// limit kernel global size, primes are stored as uint offsets from the batch start
 	if(calc_range > 4294900000){
 		calc_range = 4294900000;
 	}
@@ -921,253 +2116,346 @@ void profileGPU(progData & pd, searchData sd, sclHard hardware, int debuginfo ){
 		exit(EXIT_FAILURE);
 	}
 
-	pd.range = calc_range;
-	pd.psize = mem_size;
+	pd.range = calc_range;
+	pd.psize = mem_size;
+
+	// free temporary arrays
+	sclReleaseMemObject(d_profileprime);
+	sclReleaseMemObject(d_profbits);
+	sclReleaseMemObject(d_profgcount);
+	sclReleaseMemObject(d_profPs);
+	sclReleaseMemObject(d_profK);
+	sclReleaseMemObject(d_proflK);
+
+}
+
+
+
+void cl_sieve( sclHard hardware, searchData & search ){
+
+	progData pd;
+	bool profile = true;
+	bool debuginfo = search.verbose;
+	time_t boinc_last, boinc_curr;
+	time_t ckpt_curr, ckpt_last;
+	cl_int err = 0;
+
+	// setup kernel parameters for each search box.  box 0 holds the shared state.
+	vector<searchData> box = readBoxes(search);
+	searchData & sd = box[0];
+	uint32_t nbox = sd.nbox;
+
+	for(auto & b : box){
+		fprintf(stderr, "Starting sieve at p: %" PRIu64 " n: %u k: %u\nStopping sieve at P: %" PRIu64 " N: %u K: %u\n", b.pmin, b.nmin+1, b.kmin, b.pmax, b.nmax, b.kmax);
+		if(boinc_is_standalone()){
+			printf("Starting sieve at p: %" PRIu64 " n: %u k: %u\nStopping sieve at P: %" PRIu64 " N: %u K: %u\n", b.pmin, b.nmin+1, b.kmin, b.pmax, b.nmax, b.kmax);
+		}
+	}
+
+
+	// all kernels are one program, built on other threads while the host sieves small primes,
+	// reads the checkpoint and counts primes for the profile.  each box gets its own build, the
+	// sieve kernel is compiled for the box's parameters.
+	vector<string> source(nbox);
+	vector<cl_program> program(nbox, NULL);
+	vector<thread> build;
 
-	// free temporary array
-	sclReleaseMemObject(d_profileprime);
+	for(uint32_t b = 0; b < nbox; ++b){
 
-}
+		// the kernel loop runs kernel_nstep/nstep times per launch, unroll more when each step is cheap.
+		char sieve_opt[256];
+		uint32_t unroll = (box[b].nstep < 32) ? 4 : (box[b].nstep == 32) ? 2 : 1;
 
+		char step_opt[32] = "";
+		if(box[b].wstep){
+			snprintf(step_opt, sizeof(step_opt), " -D WSTEP=%uu", box[b].wstep);
+		}
+		// the FP64 kernel takes the full step
+		if(fp64Range(box[b])){
+			size_t len = strlen(step_opt);
+			snprintf(step_opt + len, sizeof(step_opt) - len, " -D FPSTEP=%uu", (box[b].wstep) ? box[b].wstep : box[b].nstep);
+		}
 
+		snprintf(sieve_opt, sizeof(sieve_opt), "-D NSTEP=%uu -D MONT_NSTEP=%uu -D NMAX=%uu -D KMIN=%uu -D KMAX=%uu -D UNROLL=%u -D PRESIEVE_PRIMES=%u%s%s",
+				box[b].nstep, box[b].mont_nstep, box[b].nmax, box[b].kmin, box[b].kmax, unroll, (uint32_t)primesieve_count_primes(3, presieve_limit),
+				step_opt, (sd.fused) ? " -D FUSED_SETUP" : "");
 
-void cl_sieve( sclHard hardware, searchData & sd ){
+		// the sieve source goes in once per lane count
+		string sieve = (box[b].cw) ? sievecw_cl : sieve_cl;
 
-	progData pd;
-	bool profile = true;
-	bool debuginfo = false;
-	time_t boinc_last, boinc_curr;
-	time_t ckpt_curr, ckpt_last;
-	cl_int err = 0;
+		source[b] = string(control_cl) + clearresult_cl + setup_cl + check_cl + scan_cl + presieve_cl + getsegprimes_cl + segsieve_cl
+				+ factorbuf_cl + goodfactor_cl + sieve + "#define LANES 2\n" + sieve + "#define LANES 4\n" + sieve;
+
+		build.push_back( thread( [&, b](string opt){ program[b] = sclGetCLProgram(source[b].c_str(), "pcwsieve", hardware, 1, debuginfo, opt.c_str()); }, string(sieve_opt) ) );
+	}
 
 	sieve_small_primes(11);
 
-	// setup kernel parameters
-	setupSearch(sd);
+	setupSegSieve(pd, sd, hardware);
 
-	fprintf(stderr, "Starting sieve at p: %" PRIu64 " n: %u k: %u\nStopping sieve at P: %" PRIu64 " N: %u K: %u\n", sd.pmin, sd.nmin+1, sd.kmin, sd.pmax, sd.nmax, sd.kmax);
-	if(boinc_is_standalone()){
-		printf("Starting sieve at p: %" PRIu64 " n: %u k: %u\nStopping sieve at P: %" PRIu64 " N: %u K: %u\n", sd.pmin, sd.nmin+1, sd.kmin, sd.pmax, sd.nmax, sd.kmax);
-	}
+	pd.box.resize(nbox);
 
+	// factor verification threads, -t or up to 4
+	uint32_t vthreads = sd.threads;
+	if(vthreads == 0){
+		vthreads = min(thread::hardware_concurrency(), 4u);
+	}
+	if(vthreads < 1){
+		vthreads = 1;
+	}
+	pd.verify = new workPool(vthreads);
 
 	// device arrays
-	pd.d_primecount = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, 2*sizeof(cl_uint), NULL, &err );
-        if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
+	for(uint32_t s = 0; s < 2; ++s){
+		pd.d_primecount[s] = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+			printf( "ERROR: clCreateBuffer failure.\n" );
+			exit(EXIT_FAILURE);
+		}
 	}
-        pd.d_flag = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err );
-        if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
+
+
+	// resume from checkpoint or clear the results file
+	loadState( box.data() );
+
+	// reuse saved profile results for this device and each box's search class.  the range and prime
+	// array size are shared, every box's line has to agree on them.
+	uint64_t devicehash = sclGetDeviceHash(hardware);
+	bool tuned = true;
+	uint32_t trange[2], tpsize[2];
+
+	for(uint32_t b = 0; b < nbox; ++b){
+		if(fp64Forced(box[b]) || !read_tune(pd, box[b], devicehash, trange[b > 0], tpsize[b > 0])
+				|| (b > 0 && (trange[1] != trange[0] || tpsize[1] != tpsize[0]))){
+			tuned = false;
+		}
 	}
-        pd.d_factorP = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, numresults*sizeof(cl_long), NULL, &err );
-        if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
+
+	if(tuned){
+		pd.range = trange[0];
+		pd.psize = tpsize[0];
+		profile = false;
+		if(debuginfo){
+			printf("Using saved profile: range %u, psize %u, kernel_nstep %u\n", pd.range, pd.psize, sd.kernel_nstep);
+		}
 	}
-        pd.d_factorKN = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, numresults*sizeof(cl_uint2), NULL, &err );
-        if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
+	else{
+		profileRange(pd, sd);
 	}
-	pd.d_factorcount = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err );
-        if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
+
+	for(auto & t : build){
+		t.join();
 	}
 
+	for(uint32_t b = 0; b < nbox; ++b){
 
-	if(sd.cw){
-		if(sd.nstep == 32){
-			pd.sieve = sclGetCLSoftware(sievecw_cl,"sievecw32",hardware, 1, debuginfo);
-		}
-		else if(sd.nstep < 32){
-			pd.sieve = sclGetCLSoftware(sievecw_cl,"sievecwsm",hardware, 1, debuginfo);
+		boxData & bd = pd.box[b];
+		const char * name;
+
+		if(box[b].cw){
+			name = (box[b].nstep == 32) ? "sievecw32" : "sievecwsm";
 		}
 		else{
-			pd.sieve = sclGetCLSoftware(sievecw_cl,"sievecw",hardware, 1, debuginfo);
+			name = (box[b].nstep == 32) ? "sieve32" : "sievesm";
 		}
-	}
-	else{
-		if(sd.nstep == 32){
-			pd.sieve = sclGetCLSoftware(sieve_cl,"sieve32",hardware, 1, debuginfo);
+
+		const char * kname[3] = { name, (box[b].cw) ? "sievecwwide" : "sievewide", (box[b].cw) ? "sievecwfp" : "sievefp" };
+
+		// a wide step box also has the wide kernels, and p < 2^50 the FP64 ones, for the profiler to try.  -S 4 only the FP64 ones
+		bd.kinds = 1 | ((box[b].wstep) ? 2 : 0) | ((fp64Range(box[b])) ? 4 : 0);
+		if(fp64Forced(box[b])){
+			bd.kinds = 4;
 		}
-		else if(sd.nstep < 32){
-			pd.sieve = sclGetCLSoftware(sieve_cl,"sievesm",hardware, 1, debuginfo);
+
+		for(uint32_t v = 0; v < 9; ++v){
+			if(!hasSieve(bd, v)) continue;
+			string lname = string(kname[v / 3]) + lane_suffix[v % 3];
+			bd.sieve_lanes[v] = sclGetCLKernel(program[b], lname.c_str(), hardware, debuginfo);
 		}
-		else{
-			pd.sieve = sclGetCLSoftware(sieve_cl,"sieve",hardware, 1, debuginfo);
+		bd.clearresult = sclGetCLKernel(program[b], "clearresult", hardware, debuginfo);
+		bd.setup = sclGetCLKernel(program[b], "setup", hardware, debuginfo);
+		bd.check = sclGetCLKernel(program[b], "check", hardware, debuginfo);
+
+		// kernels have __attribute__ ((reqd_work_group_size(256, 1, 1)))
+		// it's still possible the CL complier picked a different size
+		if(bd.check.local_size[0] != 256){
+			bd.check.local_size[0] = 256;
+			fprintf(stderr, "Set check kernel local size to 256\n");
 		}
 	}
 
-        pd.clearn = sclGetCLSoftware(clearn_cl,"clearn",hardware, 1, debuginfo);
+	// the prime generator is shared by all boxes
+	pd.getsegprimes = sclGetCLKernel(program[0], "getsegprimes", hardware, debuginfo);
+	pd.primescan = sclGetCLKernel(program[0], "primescan", hardware, debuginfo);
+	pd.primewrite = sclGetCLKernel(program[0], "primewrite", hardware, debuginfo);
+	pd.segclear = sclGetCLKernel(program[0], "segclear", hardware, debuginfo);
+	pd.segmark = sclGetCLKernel(program[0], "segmark", hardware, debuginfo);
+	pd.segsieve = sclGetCLKernel(program[0], "segsieve", hardware, debuginfo);
 
-        pd.clearresult = sclGetCLSoftware(clearresult_cl,"clearresult",hardware, 1, debuginfo);
-
-        pd.setup = sclGetCLSoftware(setup_cl,"setup",hardware, 1, debuginfo);
-
-        pd.check = sclGetCLSoftware(check_cl,"check",hardware, 1, debuginfo);
-
-        pd.getsegprimes = sclGetCLSoftware(getsegprimes_cl,"getsegprimes",hardware, 1, debuginfo);
+	// each kernel holds a reference
+	for(auto & prog : program){
+		clReleaseProgram(prog);
+	}
 
 
-	// kernels have __attribute__ ((reqd_work_group_size(256, 1, 1)))
-	// it's still possible the CL complier picked a different size
 	if(pd.getsegprimes.local_size[0] != 256){
 		pd.getsegprimes.local_size[0] = 256;
 		fprintf(stderr, "Set getsegprimes kernel local size to 256\n");
 	}
-	if(pd.check.local_size[0] != 256){
-		pd.check.local_size[0] = 256;
-		fprintf(stderr, "Set check kernel local size to 256\n");
+	if(pd.segsieve.local_size[0] != 256){
+		pd.segsieve.local_size[0] = 256;
+		fprintf(stderr, "Set segsieve kernel local size to 256\n");
+	}
+	if(pd.primescan.local_size[0] != 256){
+		pd.primescan.local_size[0] = 256;
+		fprintf(stderr, "Set primescan kernel local size to 256\n");
+	}
+	if(pd.primewrite.local_size[0] != 256){
+		pd.primewrite.local_size[0] = 256;
+		fprintf(stderr, "Set primewrite kernel local size to 256\n");
 	}
 
+	// one work-group scans all the counts
+	sclSetGlobalSize( pd.primescan, 256 );
 
-	if( sd.test ){
-		// clear result file
-		FILE * temp_file = my_fopen(RESULTS_FILENAME,"w");
-		if (temp_file == NULL){
-			fprintf(stderr,"Cannot open %s !!!\n",RESULTS_FILENAME);
+	// sieving primes for the Eratosthenes generator
+	if(pd.erato){
+		pd.d_sprimes = clCreateBuffer( hardware.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, pd.nsprimes*sizeof(cl_uint), pd.h_sprimes, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+			printf( "ERROR: clCreateBuffer failure.\n" );
 			exit(EXIT_FAILURE);
 		}
-		fclose(temp_file);
+		sclSetKernelArg(pd.segmark, 2, sizeof(cl_mem), &pd.d_sprimes);
+		sclSetKernelArg(pd.segmark, 3, sizeof(uint32_t), &pd.nsmall);
+		sclSetKernelArg(pd.segsieve, 2, sizeof(cl_mem), &pd.d_sprimes);
+		sclSetKernelArg(pd.segsieve, 3, sizeof(uint32_t), &pd.ncoop);
+		sclSetKernelArg(pd.segsieve, 4, sizeof(uint32_t), &pd.nsmall);
+		fprintf(stderr, "Using sieve of Eratosthenes prime generator, %u sieving primes\n", pd.nsprimes);
 	}
 	else{
-		// Resume from checkpoint if there is one
-		if( read_state( sd ) ){
-			if(boinc_is_standalone()){
-				printf("Resuming search from checkpoint. Current p: %" PRIu64 "\n", sd.p);
-			}
-			fprintf(stderr,"Resuming search from checkpoint. Current p: %" PRIu64 "\n", sd.p);
+		fprintf(stderr, "Using PRP prime generator\n");
+	}
+	if(sd.fused){
+		fprintf(stderr, "Prime generator does the setup kernel's work\n");
+	}
+	if(nbox > 1){
+		fprintf(stderr, "Searching %u boxes\n", nbox);
+	}
 
-			//trying to resume a finished workunit
-			if( sd.p == sd.pmax ){
-				if(boinc_is_standalone()){
-					printf("Workunit complete.\n");
-				}
-				fprintf(stderr,"Workunit complete.\n");
-				boinc_finish(EXIT_SUCCESS);
-			}
-		}
-		// starting from beginning
-		else{
-			// clear result file
-			FILE * temp_file = my_fopen(RESULTS_FILENAME,"w");
-			if (temp_file == NULL){
-				fprintf(stderr,"Cannot open %s !!!\n",RESULTS_FILENAME);
-				exit(EXIT_FAILURE);
-			}
-			fclose(temp_file);
+	if(!tuned){
+		profileGPU(pd,sd,hardware,debuginfo);
+	}
 
-			// setup boinc trickle up
-			sd.last_trickle = (uint64_t)time(NULL);
+	// number of gpu workgroups, used to size the checksum array on gpu
+	pd.numgroups = (pd.psize / pd.box[0].check.local_size[0]) + 2;
+
+	// the prime generator's buffers cover the largest range the prime array allows at pmax, see retune
+	uint64_t maxrange = (uint64_t)( (double)pd.psize / 1.25 * log((double)sd.pmax) );
+	pd.maxrange = min( max(maxrange, (uint64_t)pd.range), (uint64_t)4294900000 );
+	pd.d_bits = allocGenBuffers(pd, hardware, pd.maxrange, pd.d_gcount);
+	setGenSize(pd, pd.range);
+
+	// allocate gpu P and Ps arrays of each batch slot, shared by the boxes
+	// primes are uint offsets from the start of the batch
+	for(uint32_t s = 0; s < 2; ++s){
+		pd.d_primes[s] = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, pd.psize*sizeof(cl_uint), NULL, &err);
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+			printf( "ERROR: clCreateBuffer failure.\n" );
+			exit(EXIT_FAILURE);
+		}
+		pd.d_Ps[s] = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, pd.psize*sizeof(cl_ulong), NULL, &err );
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+			printf( "ERROR: clCreateBuffer failure.\n" );
+			exit(EXIT_FAILURE);
 		}
 	}
 
-	// kernel used in profileGPU, setup arg
-	sclSetKernelArg(pd.clearn, 0, sizeof(cl_mem), &pd.d_primecount);
-	sclSetGlobalSize( pd.clearn, 64 );
+	// second queue for the prime generator and setup, so they overlap the sieve of the batch before
+	pd.gen_queue = clCreateCommandQueue(hardware.context, hardware.device, CL_QUEUE_PROFILING_ENABLE, &err);
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateCommandQueue failure.\n");
+		printf( "ERROR: clCreateCommandQueue failure.\n" );
+		exit(EXIT_FAILURE);
+	}
 
-	profileGPU(pd,sd,hardware,debuginfo);
+	for(uint32_t b = 0; b < nbox; ++b){
 
-	// number of gpu workgroups, used to size the checksum array on gpu
-	pd.numgroups = (pd.psize / pd.check.local_size[0]) + 2;
+		searchData & bs = box[b];
+		boxData & bd = pd.box[b];
 
-	sclSetGlobalSize( pd.getsegprimes, (pd.range/60)+1 );
-	sclSetGlobalSize( pd.setup, pd.psize );
-	sclSetGlobalSize( pd.sieve, pd.psize );
-	sclSetGlobalSize( pd.check, pd.psize );
-	sclSetGlobalSize( pd.clearresult, pd.numgroups );
+		sclSetGlobalSize( bd.setup, pd.psize );
+		for(uint32_t v = 0; v < 9; ++v){
+			if(!hasSieve(bd, v)) continue;
+			uint64_t threads = (pd.psize + (1u << (v % 3)) - 1) >> (v % 3);
+			if(sd.compute){
+				threads = min(threads, (uint64_t)_sclGetMaxComputeUnits(hardware.device) * PERSISTENT_THREADS);
+			}
+			sclSetGlobalSize( bd.sieve_lanes[v], threads );
+		}
+		// the profile times kernel_nstep chunks first, then switches
+		if(sd.compute && !profile){
+			bs.kernel_nstep = persistentNstep(bs);
+		}
+		bd.sieve = bd.sieve_lanes[ sieveIndex(bs) ];
+		sclSetGlobalSize( bd.check, pd.psize );
+		sclSetGlobalSize( bd.clearresult, max(pd.numgroups, (uint32_t)CTL_HEADER) );
 
-	// allocate gpu P, Ps, K, lastK arrays
-	pd.d_primes = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, pd.psize*sizeof(cl_ulong), NULL, &err);
-        if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
-	}
-	pd.d_Ps = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, pd.psize*sizeof(cl_ulong), NULL, &err );
-	if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
-	}
-	pd.d_K = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, pd.psize*sizeof(cl_ulong), NULL, &err );
-	if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
-	}
-	pd.d_lK = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, pd.psize*sizeof(cl_ulong), NULL, &err );
-	if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
-	}
-        pd.d_checksum = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, pd.numgroups*sizeof(cl_ulong), NULL, &err );
-        if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
-                printf( "ERROR: clCreateBuffer failure.\n" );
-		exit(EXIT_FAILURE);
-	}
+		// allocate gpu K, lastK arrays of each batch slot
+		for(uint32_t s = 0; s < 2; ++s){
+			bd.d_K[s] = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, pd.psize*sizeof(cl_ulong), NULL, &err );
+			if ( err != CL_SUCCESS ) {
+				fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+				printf( "ERROR: clCreateBuffer failure.\n" );
+				exit(EXIT_FAILURE);
+			}
+			bd.d_lK[s] = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, pd.psize*sizeof(cl_ulong), NULL, &err );
+			if ( err != CL_SUCCESS ) {
+				fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+				printf( "ERROR: clCreateBuffer failure.\n" );
+				exit(EXIT_FAILURE);
+			}
+		}
+		// control blocks of both result slots
+		allocResults(pd, bd, hardware);
+
+
+		// set static kernel args.  the batch slot's arrays are set by setSlotArgs, the result slot's by setResultArgs
+		sclSetKernelArg(bd.clearresult, 1, sizeof(uint32_t), &pd.numgroups);
+		////////////////////////
+
+		sclSetKernelArg(bd.setup, 4, sizeof(uint64_t), &bs.r0);
+		sclSetKernelArg(bd.setup, 5, sizeof(int32_t), &bs.bbits);
+		sclSetKernelArg(bd.setup, 6, sizeof(uint32_t), &bs.nmin);
+		sclSetKernelArg(bd.setup, 7, sizeof(uint64_t), &bs.r1);
+		sclSetKernelArg(bd.setup, 8, sizeof(int32_t), &bs.bbits1);
+		sclSetKernelArg(bd.setup, 9, sizeof(uint32_t), &bs.lastN);
+		////////////////////////
+
+		for(uint32_t v = 0; v < 9; ++v){
+			if(!hasSieve(bd, v)) continue;
+			sclSoft & k = bd.sieve_lanes[v];
+
+			// the wide kernels step wstep
+			sclSetKernelArg(k, 8, sizeof(uint32_t), (v / 3 == 1) ? &bs.wstep : &bs.nstep);
+			sclSetKernelArg(k, 9, sizeof(uint32_t), &bs.kernel_nstep);
+			sclSetKernelArg(k, 10, sizeof(uint32_t), &bs.mont_nstep);
+			sclSetKernelArg(k, 11, sizeof(uint32_t), &bs.nmax);
+			sclSetKernelArg(k, 12, sizeof(uint32_t), &bs.kmin);
+			sclSetKernelArg(k, 13, sizeof(uint32_t), &bs.kmax);
+		}
 
+		// factor arrays sized for this box's expected factor rate, grown if a batch overflows them
+		allocFactors(pd, bd, hardware, factorBufferSize(bs, pd.range));
+		if(debuginfo) printf("box %u factor buffer: %u\n", b, bd.maxfactors);
+		////////////////////////
 
-	// set static kernel args
-	sclSetKernelArg(pd.clearresult, 0, sizeof(cl_mem), &pd.d_flag);
-	sclSetKernelArg(pd.clearresult, 1, sizeof(cl_mem), &pd.d_factorcount);
-	sclSetKernelArg(pd.clearresult, 2, sizeof(cl_mem), &pd.d_checksum);
-	sclSetKernelArg(pd.clearresult, 3, sizeof(cl_mem), &pd.d_primecount);
-	sclSetKernelArg(pd.clearresult, 4, sizeof(uint32_t), &pd.numgroups);
-
-	////////////////////////
-	sclSetKernelArg(pd.getsegprimes, 3, sizeof(cl_mem), &pd.d_primes);
-	sclSetKernelArg(pd.getsegprimes, 4, sizeof(cl_mem), &pd.d_primecount);
-	////////////////////////
-
-	sclSetKernelArg(pd.setup, 0, sizeof(cl_mem), &pd.d_primes);
-	sclSetKernelArg(pd.setup, 1, sizeof(cl_mem), &pd.d_Ps);
-	sclSetKernelArg(pd.setup, 2, sizeof(cl_mem), &pd.d_K);
-	sclSetKernelArg(pd.setup, 3, sizeof(cl_mem), &pd.d_lK);
-	sclSetKernelArg(pd.setup, 4, sizeof(uint64_t), &sd.r0);
-	sclSetKernelArg(pd.setup, 5, sizeof(int32_t), &sd.bbits);
-	sclSetKernelArg(pd.setup, 6, sizeof(uint32_t), &sd.nmin);
-	sclSetKernelArg(pd.setup, 7, sizeof(uint64_t), &sd.r1);
-	sclSetKernelArg(pd.setup, 8, sizeof(int32_t), &sd.bbits1);
-	sclSetKernelArg(pd.setup, 9, sizeof(uint32_t), &sd.lastN);
-	sclSetKernelArg(pd.setup, 10, sizeof(cl_mem), &pd.d_primecount);
-	////////////////////////
-
-	sclSetKernelArg(pd.sieve, 0, sizeof(cl_mem), &pd.d_primes);
-	sclSetKernelArg(pd.sieve, 1, sizeof(cl_mem), &pd.d_Ps);
-	sclSetKernelArg(pd.sieve, 2, sizeof(cl_mem), &pd.d_K);
-	sclSetKernelArg(pd.sieve, 3, sizeof(cl_mem), &pd.d_primecount);
-	sclSetKernelArg(pd.sieve, 4, sizeof(cl_mem), &pd.d_factorKN);
-	sclSetKernelArg(pd.sieve, 5, sizeof(cl_mem), &pd.d_factorP);
-	sclSetKernelArg(pd.sieve, 6, sizeof(cl_mem), &pd.d_factorcount);
-
-	sclSetKernelArg(pd.sieve, 8, sizeof(uint32_t), &sd.nstep);
-	sclSetKernelArg(pd.sieve, 9, sizeof(uint32_t), &sd.kernel_nstep);
-	sclSetKernelArg(pd.sieve, 10, sizeof(uint32_t), &sd.mont_nstep);
-	sclSetKernelArg(pd.sieve, 11, sizeof(uint32_t), &sd.nmax);
-	sclSetKernelArg(pd.sieve, 12, sizeof(uint32_t), &sd.kmin);
-	sclSetKernelArg(pd.sieve, 13, sizeof(uint32_t), &sd.kmax);
-	////////////////////////
-
-	sclSetKernelArg(pd.check, 0, sizeof(cl_mem), &pd.d_K);
-	sclSetKernelArg(pd.check, 1, sizeof(cl_mem), &pd.d_lK);
-	sclSetKernelArg(pd.check, 2, sizeof(cl_mem), &pd.d_flag);
-	sclSetKernelArg(pd.check, 3, sizeof(cl_mem), &pd.d_primecount);
-	sclSetKernelArg(pd.check, 4, sizeof(cl_mem), &pd.d_primes);
-	sclSetKernelArg(pd.check, 5, sizeof(cl_mem), &pd.d_checksum);
-	sclSetKernelArg(pd.check, 6, sizeof(uint32_t), &pd.numgroups);
-	////////////////////////
+		sclSetKernelArg(bd.check, 5, sizeof(uint32_t), &pd.numgroups);
+		////////////////////////
+	}
 
 
 	fprintf(stderr,"Starting search...\n");
@@ -1178,21 +2466,73 @@ void cl_sieve( sclHard hardware, searchData & sd ){
 	time(&boinc_last);
 	time(&ckpt_last);
 
-	printf("nstep: %u\n",sd.nstep);
+	for(auto & b : box){
+		printf("nstep: %u\n",b.nstep);
+	}
 
-	// clear results, checksum, total prime counts
-	sclEnqueueKernel(hardware, pd.clearresult);
+	// clear the control blocks of both result slots
+	clearResultSlot(pd, hardware, 0);
+	clearResultSlot(pd, hardware, 1);
 
 	time_t totals, totalf;
 	if(boinc_is_standalone()){
 		time(&totals);
 	}
 
-	// main search loop
-	for(uint64_t stop; sd.p < sd.pmax; sd.p += pd.range){
+	// host thread CPU use over the search, reported per hour of GPU run time
+	spin_us = sd.spin;
+	double cpu_start = threadCPUTime();
+	auto wall_start = chrono::steady_clock::now();
+
+	// results and position at the last checkpoint, the search goes back to it if a factor buffer overflows
+	vector<searchData> ckpt = box;
+	uint64_t batch = 0;
+
+	// the prime generator and setup go on their own queue.  batch slots alternate, the sieve of one
+	// batch runs while the next batch's primes are generated.
+	sclHard genhw = hardware;
+	genhw.queue = pd.gen_queue;
+	cl_event prevDone = NULL;	// end of the last batch
+
+	// main search loop.  the last pass gathers the final results, and exits once they fit.
+	for(uint64_t stop; ; sd.p = stop, ++batch){
+
+		bool last = (sd.p >= sd.pmax);
+
+		// results of the last checkpoint's slot, verified and checkpointed once the device is done with them.
+		// the device keeps sieving into the other slot meanwhile.  the last pass waits for them.
+		bool fits = collectResults(pd, ckpt.data(), hardware, last);
 
-		// clear prime count
-		sclEnqueueKernel(hardware, pd.clearn);
+		// errors and factor overflow of the batch before last
+		if(fits){
+			fits = batchFits(pd, ckpt.data(), hardware, batch, debuginfo);
+		}
+
+		// 1 minute checkpoint, sooner if a factor buffer is half full.  the last pass reads the final results.
+		time(&ckpt_curr);
+		if( fits && pd.rstate == 0 && (last || ((int)ckpt_curr - (int)ckpt_last) > 60 || factorsFilling(pd, batch)) ){
+			startRead(pd, hardware, sd.p, batch);
+			ckpt_last = ckpt_curr;
+			if(last){
+				fits = collectResults(pd, ckpt.data(), hardware, true);
+			}
+		}
+
+		if(!fits){
+			// a factor buffer was grown, search again from the last checkpoint
+			for(uint32_t b = 0; b < nbox; ++b){
+				box[b].p = ckpt[b].p;
+			}
+			last = false;
+		}
+
+		if(last) break;
+
+		// follow the target kernel time as clocks, load and prime density change
+		retune(pd, box, sd.p, debuginfo);
+
+		// this batch's slot was last used two batches ago, that batch was waited on
+		setSlotArgs(pd, sd, batch & 1, profile);
 
 		stop = sd.p + pd.range;
 		if(stop > sd.pmax) stop = sd.pmax;
@@ -1206,114 +2546,301 @@ void cl_sieve( sclHard hardware, searchData & sd ){
 			boinc_last = boinc_curr;
 		}
 
-		// 1 minute checkpoint
-		time(&ckpt_curr);
-		if( ((int)ckpt_curr - (int)ckpt_last) > 60 ){
-			sleepCPU(hardware);
-			boinc_begin_critical_section();
-			getResults(pd, sd, hardware);
-			checkpoint(sd);
-			boinc_end_critical_section();
-			ckpt_last = ckpt_curr;
-			// clear result arrays
-			sclEnqueueKernel(hardware, pd.clearresult);
-		}
+		// get primes, in ascending order
+		pd.gen_event = enqueueGen(pd, genhw, setPrimeArgs(pd, sd.p, stop));
 
-		// get primes
-		int32_t wheelidx;
-		uint64_t kernel_start = sd.p;
-		findWheelOffset(kernel_start, wheelidx);
+		// setup Ps, K kernel of each box, unless the prime generator did box 0's
+		// primes are offsets from sd.p
+		for(uint32_t b = 0; b < nbox; ++b){
+			sclSetKernelArg(pd.box[b].setup, 11, sizeof(uint64_t), &sd.p);
+			if(!sd.fused || b > 0){
+				sclEnqueueKernel(genhw, pd.box[b].setup);
+			}
+		}
 
-		sclSetKernelArg(pd.getsegprimes, 0, sizeof(uint64_t), &kernel_start);
-		sclSetKernelArg(pd.getsegprimes, 1, sizeof(uint64_t), &stop);
-		sclSetKernelArg(pd.getsegprimes, 2, sizeof(int32_t), &wheelidx);
-		cl_event launchEvent = sclEnqueueKernelEvent(hardware, pd.getsegprimes);
+		// the sieve waits for this batch's primes, the batch before may still be sieving
+		queueWait(hardware.queue, pd.gen_queue);
+
+		// every box sieves the same primes
+		for(uint32_t b = 0; b < nbox; ++b){
+
+			searchData & bs = box[b];
+			boxData & bd = pd.box[b];
+
+			sclSetKernelArg(bd.sieve, 14, sizeof(uint64_t), &sd.p);
+			sclSetKernelArg(bd.check, 6, sizeof(uint64_t), &sd.p);
+
+			uint32_t nstart = bs.nmin;
+
+			// profile gpu sieve kernel time once, at program start.  each lane count of each kernel kind the box has
+			// sieves the next kernel_nstep of N, the fastest is kept.  adjust work size to target kernel runtime.
+			if(profile){
+				const char * kind_name[3] = { "", "wide, ", "FP64, " };
+				double kernel_ms = 0.0;
+				uint32_t best = 0;
+				bool first = true;
+				for(uint32_t v = 0; v < 9; ++v){
+					if(!hasSieve(bd, v)) continue;
+					// compare full kernel_nstep launches only
+					if(!first && nstart + bs.kernel_nstep > bs.nmax) break;
+					sclSetKernelArg(bd.sieve_lanes[v], 7, sizeof(uint32_t), &nstart);
+					sclSetKernelArg(bd.sieve_lanes[v], 14, sizeof(uint64_t), &sd.p);
+					double ms = ProfilesclEnqueueKernel(hardware, bd.sieve_lanes[v]);
+					nstart += bs.kernel_nstep;
+					if(debuginfo) printf("%s%u primes per work-item: %0.3f ms\n", kind_name[v / 3], 1u << (v % 3), ms);
+					if(first || ms < kernel_ms){
+						kernel_ms = ms;
+						best = v;
+					}
+					first = false;
+				}
+				bs.lanes = 1u << (best % 3);
+				bs.kind = best / 3;
+				bd.sieve = bd.sieve_lanes[best];
+				double multi = (double)sd.ktime / kernel_ms;
+				uint32_t new_knstep = (uint32_t)((double)bs.kernel_nstep * multi);
+				// make sure it's a multiple of nstep
+				new_knstep = (new_knstep / bs.nstep) * bs.nstep;
+				// persistent mode, the rest of N in one launch
+				if(sd.compute){
+					new_knstep = persistentNstep(bs);
+				}
+				if(debuginfo) printf("old kns %u, new kns %u\n",bs.kernel_nstep,new_knstep);
+				bs.kernel_nstep = new_knstep;
+				sclSetKernelArg(bd.sieve, 9, sizeof(uint32_t), &bs.kernel_nstep);
+				// a forced kernel isn't a profile result
+				if(!fp64Forced(bs)){
+					write_tune(pd, bs, devicehash);
+				}
+			}
 
-		// setup Ps, K kernel
-		sclEnqueueKernel(hardware, pd.setup);
+			// sieve kernel, loop to nmax
+			for(; nstart <= bs.nmax; nstart += bs.kernel_nstep){
+				sclSetKernelArg(bd.sieve, 7, sizeof(uint32_t), &nstart);
+				if(bd.sieve_event == NULL){
+					bd.sieve_event = sclEnqueueKernelEvent(hardware, bd.sieve);
+				}
+				else{
+					sclEnqueueKernel(hardware, bd.sieve);
+				}
+//				float kernel_ms = ProfilesclEnqueueKernel(hardware, bd.sieve);
+//				printf("sieve kernel time %0.2fms\n",kernel_ms);
+			}
 
-		uint32_t nstart = sd.nmin;
+			// validate checksum kernel
+			sclEnqueueKernel(hardware, bd.check);
 
-		// profile gpu sieve kernel time once, at program start.  adjust work size to target kernel runtime.
-		if(profile){
-			sclSetKernelArg(pd.sieve, 7, sizeof(uint32_t), &nstart);
-			double kernel_ms = ProfilesclEnqueueKernel(hardware, pd.sieve);
-			nstart += sd.kernel_nstep;
-			double multi = (sd.compute)?(50.0 / kernel_ms):(10.0 / kernel_ms);	// target kernel time 50ms or 10ms
-			uint32_t new_knstep = (uint32_t)((double)sd.kernel_nstep * multi);
-			// make sure it's a multiple of nstep
-			new_knstep = (new_knstep / sd.nstep) * sd.nstep;
-			if(debuginfo) printf("old kns %u, new kns %u\n",sd.kernel_nstep,new_knstep);
-			sd.kernel_nstep = new_knstep;
-			sclSetKernelArg(pd.sieve, 9, sizeof(uint32_t), &sd.kernel_nstep);
-			profile = false;
+			// control block header after this batch, checked two batches later
+			sclReadNonBlocking(hardware, CTL_HEADER*sizeof(uint32_t), bd.d_ctl[pd.rslot], batchHeader(bd, batch));
 		}
 
-		// sieve kernel, loop to nmax
-		for(; nstart <= sd.nmax; nstart += sd.kernel_nstep){
-			sclSetKernelArg(pd.sieve, 7, sizeof(uint32_t), &nstart);
-			sclEnqueueKernel(hardware, pd.sieve);
-//			float kernel_ms = ProfilesclEnqueueKernel(hardware, pd.sieve);
-//			printf("sieve kernel time %0.2fms\n",kernel_ms);
+		profile = false;
+
+		cl_event batchDone;
+		err = clEnqueueMarker(hardware.queue, &batchDone);
+		if ( err != CL_SUCCESS ) {
+			printf( "ERROR: clEnqueueMarker\n");
+			fprintf(stderr, "ERROR: clEnqueueMarker\n");
+			sclPrintErrorFlags(err);
 		}
 
-		// validate checksum kernel
-		sclEnqueueKernel(hardware, pd.check);
+		// limit cl queue depth and sleep cpu.  wait for the batch before this one, so this
+		// batch sieves while the next one's primes are generated into the other slot.
+		if(prevDone != NULL){
+			waitOnEvent(hardware, prevDone);
+		}
+		prevDone = batchDone;
 
-		// limit cl queue depth and sleep cpu
-		waitOnEvent(hardware, launchEvent);
+	}
 
+	// the final pass drained the queue
+	if(prevDone != NULL){
+		clReleaseEvent(prevDone);
 	}
 
+	// the results are in the last checkpoint's state
+	box = ckpt;
 
-	// final checkpoint
-	sleepCPU(hardware);
+
+	// final results were gathered and checkpointed by the last pass of the search loop
 	boinc_begin_critical_section();
-	sd.p = sd.pmax;
 	boinc_fraction_done(1.0);
 	if(boinc_is_standalone()) printf("Tests done: %.1f%%\n",100.0);
-	getResults(pd, sd, hardware);
-	checkpoint(sd);
 
 	// print checksum
-	char buffer[256];
-	if(sd.factorcount == 0){
-		if( sprintf( buffer, "no factors\n%016" PRIX64 "\n", sd.checksum ) < 0 ){
-			fprintf(stderr,"error in sprintf()\n");
-			exit(EXIT_FAILURE);
-		}
-	}
-	else{
-		if( sprintf( buffer, "%016" PRIX64 "\n", sd.checksum ) < 0 ){
-			fprintf(stderr,"error in sprintf()\n");
-			exit(EXIT_FAILURE);
-		}
-	}
-	report_solution( buffer );
+	reportChecksum( box.data() );
 
 	boinc_end_critical_section();
 
 
 	fprintf(stderr,"Search complete.\nfactors %" PRIu64 ", prime count %" PRIu64 "\n", sd.factorcount, sd.primecount);
+	for(uint32_t b = 1; b < nbox; ++b){
+		fprintf(stderr,"box %u factors %" PRIu64 "\n", b, box[b].factorcount);
+	}
+
+	double cpu_sec = threadCPUTime() - cpu_start;
+	double gpu_hours = chrono::duration<double>(chrono::steady_clock::now() - wall_start).count() / 3600.0;
+	if(gpu_hours > 0.0){
+		fprintf(stderr,"Host thread CPU time %0.1f sec, %0.1f sec per GPU hour\n", cpu_sec, cpu_sec / gpu_hours);
+		if(boinc_is_standalone()){
+			printf("Host thread CPU time %0.1f sec, %0.1f sec per GPU hour\n", cpu_sec, cpu_sec / gpu_hours);
+		}
+	}
 
 	if(boinc_is_standalone()){
 		time(&totalf);
 		printf("Search finished in %d sec.\n", (int)totalf - (int)totals);
-		printf("factors %" PRIu64 ", prime count %" PRIu64 ", checksum %016" PRIX64 "\n", sd.factorcount, sd.primecount, sd.checksum);
+		for(auto & b : box){
+			printf("factors %" PRIu64 ", prime count %" PRIu64 ", checksum %016" PRIX64 "\n", b.factorcount, sd.primecount, b.checksum);
+		}
 	}
 
+	// single box runs report back to the caller, for the self test
+	search = box[0];
 
-	cleanup(pd);
+	cleanup(pd, hardware);
 
 	small_primes_free();
 }
 
 
+// time the getsegprimes prime generator at several presieve depths on this device.
+// deeper presieving costs more per thread but leaves fewer numbers for the PRP test.
+void bench_presieve( sclHard hardware, searchData & sd ){
+
+	const uint32_t limits[] = { 13, 31, 61, 113, 251, 509, 1024, 2048, 4096 };
+	const uint32_t range = 1000000000;
+	const int runs = 3;
+	uint64_t low = (sd.pmin) ? sd.pmin : (1ULL << 50);
+	uint64_t high = low + range;
+	cl_int err = 0;
+
+	if(high > (UINT64_C(1)<<62)){
+		high = UINT64_C(1)<<62;
+		low = high - range;
+	}
+
+	uint64_t exact = primesieve_count_primes(low, high - 1);
+	uint32_t nprimes = (uint32_t)(exact + (exact / 10) + 1024);
+
+	cl_mem d_prime = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, nprimes*sizeof(cl_uint), NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+		printf( "ERROR: clCreateBuffer failure.\n" );
+		exit(EXIT_FAILURE);
+	}
+	cl_mem d_count = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, 2*sizeof(cl_uint), NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+		printf( "ERROR: clCreateBuffer failure.\n" );
+		exit(EXIT_FAILURE);
+	}
+
+	// getsegprimes' bitmap and work-group counts
+	uint32_t ngroups = (presieveThreads(range) + 255) / 256;
+	uint32_t gwords = presieve_words;
+	cl_mem d_bits = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, (uint64_t)ngroups*presieve_words*sizeof(cl_uint), NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+		printf( "ERROR: clCreateBuffer failure.\n" );
+		exit(EXIT_FAILURE);
+	}
+	cl_mem d_gcount = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, (ngroups+1)*sizeof(cl_uint), NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+		printf( "ERROR: clCreateBuffer failure.\n" );
+		exit(EXIT_FAILURE);
+	}
+
+	string source = string(setup_cl) + scan_cl + presieve_cl + getsegprimes_cl;
+
+	printf("Presieve benchmark, %u numbers at p=%" PRIu64 ", %" PRIu64 " primes\n", range, low, exact);
+	printf("limit\tprimes\tms\tM/sec\tprimes found\n");
+
+	for(uint32_t limit : limits){
+
+		char opt[64];
+		uint32_t nsieve = (uint32_t)primesieve_count_primes(3, limit);
+		snprintf(opt, sizeof(opt), "-D PRESIEVE_PRIMES=%u", nsieve);
+
+		cl_program program = sclGetCLProgram(source.c_str(), "presieve bench", hardware, 1, 0, opt);
+		sclSoft getsegprimes = sclGetCLKernel(program, "getsegprimes", hardware, 0);
+		sclSoft primescan = sclGetCLKernel(program, "primescan", hardware, 0);
+		sclSoft primewrite = sclGetCLKernel(program, "primewrite", hardware, 0);
+		clReleaseProgram(program);
+
+		getsegprimes.local_size[0] = 256;
+		primescan.local_size[0] = 256;
+		primewrite.local_size[0] = 256;
+
+		sclSetKernelArg(getsegprimes, 0, sizeof(uint64_t), &low);
+		sclSetKernelArg(getsegprimes, 1, sizeof(uint64_t), &high);
+		sclSetKernelArg(getsegprimes, 2, sizeof(cl_mem), &d_bits);
+		sclSetKernelArg(getsegprimes, 3, sizeof(cl_mem), &d_gcount);
+		sclSetGlobalSize( getsegprimes, ngroups * 256 );
+
+		sclSetKernelArg(primescan, 0, sizeof(cl_mem), &d_gcount);
+		sclSetKernelArg(primescan, 1, sizeof(uint32_t), &ngroups);
+		sclSetKernelArg(primescan, 2, sizeof(cl_mem), &d_count);
+		sclSetGlobalSize( primescan, 256 );
+
+		sclSetKernelArg(primewrite, 0, sizeof(uint64_t), &low);
+		sclSetKernelArg(primewrite, 1, sizeof(uint32_t), &gwords);
+		sclSetKernelArg(primewrite, 2, sizeof(cl_mem), &d_bits);
+		sclSetKernelArg(primewrite, 3, sizeof(cl_mem), &d_gcount);
+		sclSetKernelArg(primewrite, 4, sizeof(cl_mem), &d_prime);
+		sclSetGlobalSize( primewrite, ngroups * 256 );
+
+		// best of a few runs, after one to warm up
+		double best_ms = 0.0;
+		uint32_t found = 0;
+
+		for(int r = 0; r <= runs; ++r){
+			double ms = ProfilesclEnqueueKernel(hardware, getsegprimes);
+			ms += ProfilesclEnqueueKernel(hardware, primescan);
+			ms += ProfilesclEnqueueKernel(hardware, primewrite);
+			if(r == 1 || (r > 1 && ms < best_ms)){
+				best_ms = ms;
+			}
+		}
+
+		sclRead(hardware, sizeof(uint32_t), d_count, &found);
+
+		printf("%u\t%u\t%0.2f\t%0.1f\t%u%s\n", limit, nsieve, best_ms, (double)range / best_ms / 1000.0, found,
+				(found < exact) ? " ERROR" : "");
+
+		sclReleaseClSoft(getsegprimes);
+		sclReleaseClSoft(primescan);
+		sclReleaseClSoft(primewrite);
+	}
+
+	printf("The search presieves to %u.\n", presieve_limit);
+
+	sclReleaseMemObject(d_prime);
+	sclReleaseMemObject(d_count);
+	sclReleaseMemObject(d_bits);
+	sclReleaseMemObject(d_gcount);
+}
+
+
+// run one search range on the selected backend
+void sieve_range( sclHard hardware, searchData & sd ){
+
+	if(sd.cpu){
+		cpu_sieve( sd );
+	}
+	else{
+		cl_sieve( hardware, sd );
+	}
+
+}
+
+
 void run_test( sclHard hardware, searchData & sd ){
 
 	int goodtest = 0;
 
-	printf("Beginning self test of 4 ranges.\n");
+	printf("Beginning self test of 6 ranges.\n");
 
 //	-p 25636026e6 -P 25636030e6 -n 10000000 -N 25000000 -c		nstep 19
 	sd.pmin = 25636026000000;
@@ -1323,7 +2850,7 @@ void run_test( sclHard hardware, searchData & sd ){
 	sd.kmin = 0;
 	sd.kmax = 0;
 	sd.cw = true;
-	cl_sieve( hardware, sd );
+	sieve_range( hardware, sd );
 	if( sd.factorcount == 2 && sd.primecount == 129869 && sd.checksum == 0x4544591DC69ACD83 ){
 		printf("CW test case 1 passed.\n\n");
 		fprintf(stderr,"CW test case 1 passed.\n");
@@ -1345,7 +2872,7 @@ void run_test( sclHard hardware, searchData & sd ){
 	sd.kmin = 0;
 	sd.kmax = 0;
 	sd.cw = true;
-	cl_sieve( hardware, sd );
+	sieve_range( hardware, sd );
 	if( sd.factorcount == 1 && sd.primecount == 4123452 && sd.checksum == 0x8FEC30979896A3C0 ){
 		printf("CW test case 2 passed.\n\n");
 		fprintf(stderr,"CW test case 2 passed.\n");
@@ -1368,7 +2895,7 @@ void run_test( sclHard hardware, searchData & sd ){
 	sd.kmin = 5;
 	sd.kmax = 9999;
 	sd.cw = false;
-	cl_sieve( hardware, sd );
+	sieve_range( hardware, sd );
 	if( sd.factorcount == 1 && sd.primecount == 484024 && sd.checksum == 0xA7DC855BCB311759 ){
 		printf("test case 3 passed.\n\n");
 		fprintf(stderr,"test case 3 passed.\n");
@@ -1390,7 +2917,7 @@ void run_test( sclHard hardware, searchData & sd ){
 	sd.kmin = 1201;
 	sd.kmax = 9999;
 	sd.cw = false;
-	cl_sieve( hardware, sd );
+	sieve_range( hardware, sd );
 	if( sd.factorcount == 70 && sd.primecount == 1592285 && sd.checksum == 0x727796B2D3677937 ){
 		printf("test case 4 passed.\n\n");
 		fprintf(stderr,"test case 4 passed.\n");
@@ -1400,10 +2927,56 @@ void run_test( sclHard hardware, searchData & sd ){
 		printf("test case 4 failed.\n\n");
 		fprintf(stderr,"test case 4 failed.\n");
 	}
+	sd.checksum = 0;
+	sd.primecount = 0;
+	sd.factorcount = 0;
+
+//	-p11091310e6 -P11091315e6 -k 1201 -K 9999 -n 100 -N 2000000		nstep 30
+//	has spsp(2) 11091312221959 = 228479 * 48544121.  Eratosthenes range, it isn't sieved.
+	sd.pmin = 11091310000000;
+	sd.pmax = 11091315000000;
+	sd.nmin = 100;
+	sd.nmax = 2000000;
+	sd.kmin = 1201;
+	sd.kmax = 9999;
+	sd.cw = false;
+	sieve_range( hardware, sd );
+	if( sd.factorcount == 22 && sd.primecount == 166450 && sd.checksum == 0x2671FDAD6A7549BD ){
+		printf("test case 5 passed.\n\n");
+		fprintf(stderr,"test case 5 passed.\n");
+		++goodtest;
+	}
+	else{
+		printf("test case 5 failed.\n\n");
+		fprintf(stderr,"test case 5 failed.\n");
+	}
+	sd.checksum = 0;
+	sd.primecount = 0;
+	sd.factorcount = 0;
+
+//	-p576460752300e6 -P576460752305e6 -n 100 -N 2000000 -c		nstep 32
+//	has spsp(2) 2^59-1 = 179951 * 3203431780337.  PRP range, it's sieved.
+	sd.pmin = 576460752300000000;
+	sd.pmax = 576460752305000000;
+	sd.nmin = 100;
+	sd.nmax = 2000000;
+	sd.kmin = 0;
+	sd.kmax = 0;
+	sd.cw = true;
+	sieve_range( hardware, sd );
+	if( sd.factorcount == 0 && sd.primecount == 122530 && sd.checksum == 0xF6956A0B8E32AEF3 ){
+		printf("CW test case 6 passed.\n\n");
+		fprintf(stderr,"CW test case 6 passed.\n");
+		++goodtest;
+	}
+	else{
+		printf("CW test case 6 failed.\n\n");
+		fprintf(stderr,"CW test case 6 failed.\n");
+	}
 
 
 
-	if(goodtest == 4){
+	if(goodtest == 6){
 		printf("All test cases completed successfully!\n");
 		fprintf(stderr, "All test cases completed successfully!\n");
 	}
@@ -9,6 +9,9 @@ typedef struct {
 	uint32_t nstep;
 	uint32_t mont_nstep;
 	uint32_t kernel_nstep;
+	uint32_t wstep = 0;		// full nstep when it's over 32, for the wide kernels.  nstep is 32 then.
+	uint32_t lanes = 1;		// primes per sieve work-item, picked by the profiler
+	uint32_t kind = 0;		// sieve kernel picked by the profiler: 0 the 32 step or sm kernel, 1 wide, 2 FP64
 	int32_t bbits;
 	uint64_t r0;
 	int32_t bbits1;
@@ -16,8 +19,17 @@ typedef struct {
 	uint64_t lastN;
 	bool cw = false;
 	bool test = false;
+	bool bench = false;
+	bool fused = false;		// prime generator also computes Ps, K and lK, no setup kernel
 	uint64_t checksum = 0;
 	bool compute = false;
+	bool fp64 = false;		// device has double precision with fma, see fp64Range
+	bool cpu = false;		// use the multithreaded CPU engine instead of OpenCL
+	uint32_t threads = 0;		// CPU engine thread count, 0 = all hardware threads
+	uint32_t simd = 3;		// widest CPU vector unit allowed: 0 scalar, 1 AVX2, 2 AVX-512, 3 also FP64 FMA, 4 always FP64 FMA in fp64Range
+	uint32_t ktime = 10;		// target kernel time in ms for the profile and the feedback tuning
+	uint32_t spin = 0;		// us to poll a GPU wait before sleeping until its completion callback
+	bool verbose = false;		// print OpenCL build logs, profile and retune details, and per-batch stats
 	int computeunits;
 	uint64_t primecount = 0;
 	uint64_t factorcount = 0;
@@ -27,6 +39,12 @@ typedef struct {
 	bool write_state_a_next = true;
 	uint64_t last_trickle;
 
+	// multi-box runs, see --boxes.  box 0 holds p, primecount and the rest of the shared state,
+	// every box has its own k, n, cw, checksum and factorcount.
+	const char * boxfile = NULL;
+	uint32_t box = 0;
+	uint32_t nbox = 1;
+
 //	tpsieve option -M2, change K's modulus to 2
 	uint32_t kstep = 2;
 	uint32_t koffset = 1;
@@ -40,3 +58,24 @@ typedef struct {
 void cl_sieve( sclHard hardware, searchData & sd );
 
 void run_test( sclHard hardware, searchData & sd );
+
+void bench_presieve( sclHard hardware, searchData & sd );
+
+// host routines shared by the OpenCL and CPU sieve engines
+FILE *my_fopen(const char * filename, const char * mode);
+
+// state and results routines take the box list, a single search is one box
+void setupSearch( searchData & sd );
+
+bool fp64Range( searchData & sd );
+bool fp64Forced( searchData & sd );
+
+bool eratoRange( const searchData & sd );
+
+void loadState( searchData * box );
+
+void checkpoint( searchData * box );
+
+void processFactors( searchData & sd, uint32_t factorcount, int64_t * factorP, cl_uint2 * factorKN );
+
+void reportChecksum( searchData * box );
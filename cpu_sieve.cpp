@@ -0,0 +1,941 @@
+/*
+	PCWSieve CPU engine
+
+	Multithreaded host implementation of the getsegprimes, setup, sieve and check kernels.
+	Uses the same arithmetic as the kernels, so the prime count, checksum and factors
+	are bit-identical to the OpenCL path.
+
+	Search algorithm by
+	Geoffrey Reynolds, 2009
+	Ken Brazier, 2009
+
+*/
+
+#include <unistd.h>
+#include <math.h>
+
+#include <thread>
+#include <chrono>
+#include <vector>
+
+#if defined(__x86_64__) && __has_include(<immintrin.h>)
+  #include <immintrin.h>
+  #include "primesieve/cpuid.hpp"
+  #define ENABLE_MULTIARCH_SIMD
+#endif
+
+#include "boinc_api.h"
+#include "simpleCL.h"
+
+#include "factor_proth.h"
+#include "cl_sieve.h"
+#include "cpu_sieve.h"
+#include "pool.h"
+
+using namespace std;
+
+
+// odd primes crossed off each segment before the base 2 PRP test.  a cheap filter only, it doesn't follow
+// the GPU presieve depth, the PRP test decides which numbers are sieved.
+static const uint32_t presieve_primes[] = { 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113 };
+static const int presieve_count = sizeof(presieve_primes) / sizeof(presieve_primes[0]);
+
+
+// results of one segment, or all segments since the last checkpoint
+typedef struct {
+
+	uint64_t checksum = 0;
+	uint64_t primecount = 0;
+	uint32_t flag = 0;
+
+	vector<int64_t> factorP;
+	vector<cl_uint2> factorKN;
+
+}cpuResult;
+
+
+/*
+	getsegprimes
+*/
+
+static inline uint64_t invert(uint64_t p)
+{
+	uint64_t p_inv = 1, prev = 0;
+	while (p_inv != prev) { prev = p_inv; p_inv *= 2 - p * p_inv; }
+	return p_inv;
+}
+
+
+static inline uint64_t montMul(uint64_t a, uint64_t b, uint64_t p, uint64_t q)
+{
+	unsigned __int128 ab = (unsigned __int128)a * b;
+
+	uint64_t m = (uint64_t)ab * q;
+
+	uint64_t mp = ((unsigned __int128)m * p) >> 64;
+
+	uint64_t ab1 = ab >> 64;
+
+	uint64_t r = ab1 - mp;
+
+	return ( ab1 < mp ) ? r + p : r;
+}
+
+
+static inline uint64_t add(uint64_t a, uint64_t b, uint64_t p)
+{
+	uint64_t c = (a >= p - b) ? p : 0;
+
+	return a + b - c;
+}
+
+
+// strong probable prime test base 2, same as the getsegprimes kernel
+static bool strong_prp_two(uint64_t N)
+{
+	uint64_t nmo = N-1;
+	int t = __builtin_ctzll(nmo);
+	uint64_t exp = N >> t;
+	uint64_t curBit = 0x8000000000000000;
+	curBit >>= ( __builtin_clzll(exp) + 1 );
+	uint64_t q = invert(N);
+	uint64_t one = (-N) % N;
+	nmo = N - one;
+	uint64_t a = add(one, one, N);
+
+	/* r <-- a^d mod N, assuming d odd */
+	while( curBit )
+	{
+		a = montMul(a,a,N,q);
+
+		if(exp & curBit){
+			a = add(a,a,N);
+		}
+
+		curBit >>= 1;
+	}
+
+	/* Clause 1. and s = 0 case for clause 2. */
+	if (a == one || a == nmo){
+		return true;
+	}
+
+	/* 0 < s < t cases for clause 2. */
+	for (int s = 1; s < t; ++s){
+
+		a = montMul(a,a,N,q);
+
+		if(a == nmo){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// strong probable prime test to base a < N
+static bool strong_prp(uint64_t N, uint64_t a)
+{
+	uint64_t nmo = N-1;
+	int t = __builtin_ctzll(nmo);
+	uint64_t exp = N >> t;
+	uint64_t q = invert(N);
+	uint64_t one = (-N) % N;
+	nmo = N - one;
+	uint64_t b = (uint64_t)(((unsigned __int128)a << 64) % N);
+	uint64_t r = one;
+
+	for(uint64_t curBit = 0x8000000000000000 >> __builtin_clzll(exp); curBit; curBit >>= 1){
+		r = montMul(r,r,N,q);
+		if(exp & curBit){
+			r = montMul(r,b,N,q);
+		}
+	}
+
+	if (r == one || r == nmo){
+		return true;
+	}
+
+	for (int s = 1; s < t; ++s){
+
+		r = montMul(r,r,N,q);
+
+		if(r == nmo){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// a base 2 strong probable prime N < 2^64 is prime if it's one to these bases too, Jim Sinclair's set.
+// the Eratosthenes generator's ranges use it, so the CPU engine also drops spsp(2) there.
+static bool sprp_two_is_prime(uint64_t N)
+{
+	static const uint64_t bases[] = { 325, 9375, 28178, 450775, 9780504, 1795265022 };
+
+	for(uint64_t a : bases){
+		a %= N;
+		if(a != 0 && !strong_prp(N, a)){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+	setup
+*/
+
+static inline uint64_t mulmod_REDC (const uint64_t a, const uint64_t b, const uint64_t N, const uint64_t Ns)
+{
+	unsigned __int128 ab = (unsigned __int128)a * b;
+
+	uint64_t rax = (uint64_t)ab;
+	uint64_t rcx = ab >> 64;
+
+	rax *= Ns;
+	rcx += ( (rax != 0)?1:0 );
+	rax = (uint64_t)(((unsigned __int128)rax * N) >> 64) + rcx;
+
+	rcx = rax - N;
+	rax = (rax>N)?rcx:rax;
+
+	return rax;
+}
+
+
+static inline uint64_t invmod2pow_ul (const uint64_t n)
+{
+	uint64_t r;
+
+	const uint32_t in = (uint32_t)n;
+
+	// Suggestion from PLM: initing the inverse to (3*n) XOR 2 gives the
+	// correct inverse modulo 32, then 3 (for 32 bit) or 4 (for 64 bit)
+	// Newton iterations are enough.
+	r = (n+n+n) ^ ((uint64_t)2);
+	// Newton iteration
+	r += r - (uint64_t)((uint32_t)(r) * (uint32_t)(r) * in);
+	r += r - (uint64_t)((uint32_t)(r) * (uint32_t)(r) * in);
+	r += r - (uint64_t)((uint32_t)(r) * (uint32_t)(r) * in);
+	r += r - r * r * n;
+
+	return r;
+}
+
+
+// Like mulmod_REDC(a, 1, N, Ns) == mulmod_REDC(1, 1, N, Ns*a).
+static inline uint64_t mod_REDC(const uint64_t a, const uint64_t N, const uint64_t Ns)
+{
+	uint64_t rax = Ns*a;
+	uint64_t rcx = (rax!=0)?1:0;
+
+	rax = (uint64_t)(((unsigned __int128)rax * N) >> 64) + rcx;
+	rcx = rax - N;
+	rax = (rax>N)?rcx:rax;
+
+	return rax;
+}
+
+
+// A Left-to-Right version of the powmod.  Calcualtes 2^-(first 6 bits), then just keeps squaring and dividing by 2 when needed.
+static uint64_t invpowmod_REDClr (const uint64_t N, const uint64_t Ns, const uint64_t r0, const int bits, const uint32_t nmin)
+{
+	uint64_t r = r0;
+
+	// Now work through the other bits of nmin.
+	for(int bbits = bits; bbits >= 0; --bbits) {
+		// Just keep squaring r.
+		r = mulmod_REDC(r, r, N, Ns);
+		// If there's a one bit here, multiply r by 2^-1 (aka divide it by 2 mod N).
+		if(nmin & (1u << bbits)) {
+			r += ( (r&1) ? N : 0 );
+			r = r >> 1;
+		}
+	}
+
+	// Convert back to standard.
+	return mod_REDC (r, N, Ns);
+}
+
+
+/*
+	sieve
+*/
+
+// Compute T=a<<s; m = (T*Ns)%2^64; T += m*N; if (T>N) T-= N;
+// rax is passed in as a * Ns.  Valid for any 0 < nstep < 64.
+static inline uint64_t shiftmod_REDC (const uint64_t a, const uint64_t N, uint64_t rax, const uint32_t mont_nstep, const uint32_t nstep)
+{
+	uint64_t rcx;
+
+	rax = rax << mont_nstep; // So this is a*Ns*(1<<s) == (a<<s)*Ns.
+	rcx = a >> nstep;
+
+	rcx += ((rax != 0)?1:0);	// if rax != 0, increase rcx
+
+	rax = (uint64_t)(((unsigned __int128)rax * N) >> 64) + rcx;
+
+	rcx = rax - N;
+	rax = (rax>N)?rcx:rax;
+
+	return rax;
+}
+
+
+// goodfactor() from the sieve kernels, a generated table of the small primes to GOODFACTOR_LIMIT
+#define __constant static const
+#include "goodfactor.cl"
+#undef __constant
+
+
+static void add_factor(cpuResult & res, uint64_t P, int s, uint32_t the_k, uint32_t the_n)
+{
+	cl_uint2 kn;
+	kn.s[0] = the_k;
+	kn.s[1] = the_n;
+
+	res.factorP.push_back( (s==1) ? (int64_t)P : -((int64_t)P) );
+	res.factorKN.push_back( kn );
+}
+
+
+// setup kernel, Ps and K for nmin and lastN
+static inline void sieve_setup(const searchData & sd, uint64_t P, uint64_t & Ps, uint64_t & k0, uint64_t & lk)
+{
+	Ps = -invmod2pow_ul(P); // Ns = -N^{-1} % 2^64
+
+	// Calculate k0, not in Montgomery form.
+	k0 = invpowmod_REDClr(P, Ps, sd.r0, sd.bbits, sd.nmin);
+
+	// calculate k for last value of N, for checksum.
+	lk = invpowmod_REDClr(P, Ps, sd.r1, sd.bbits1, sd.lastN);
+}
+
+
+// the factor test of the sieve kernels for one K at N, stepping nstep
+static inline void test_k(const searchData & sd, uint64_t P, uint64_t k0, uint32_t n, uint32_t nstep, cpuResult & res)
+{
+	// Select the even one.
+	uint64_t kpos = (k0 & 1)?(P - k0):k0;
+
+	uint32_t i = __builtin_ctzll(kpos);
+
+	// the sieve32, sievesm and sievewide kernels all reduce to this test
+	if(i <= nstep && (kpos >> i) <= UINT32_MAX){
+		uint32_t the_k = (uint32_t)(kpos >> i);
+		uint32_t the_n = n + i;
+		int s = (kpos==k0)?-1:1;
+
+		if(sd.cw){
+			if(the_k <= the_n){
+				while(the_k < the_n){
+					the_k <<= 1;
+					the_n--;
+				}
+				if(the_k == the_n && the_n <= sd.nmax && goodfactor(the_k, the_n, s)){
+					add_factor(res, P, s, the_k, the_n);
+				}
+			}
+		}
+		else if(the_k >= sd.kmin && the_k <= sd.kmax && the_n <= sd.nmax && goodfactor(the_k, the_n, s)){
+			add_factor(res, P, s, the_k, the_n);
+		}
+	}
+}
+
+
+// check kernel, should match if we calculated from nmin to nmax correctly.
+static inline void sieve_check(uint64_t P, uint64_t k0, uint64_t lk, cpuResult & res)
+{
+	if(k0 != lk){
+		res.flag = 1;
+	}
+
+	res.checksum += P + k0;
+	++res.primecount;
+}
+
+
+// setup, sieve and check one prime over the whole N range.
+// a wide step box steps wstep like sievewide, the last step is short so it still stops at lastN.
+static void sieve_prime(const searchData & sd, uint64_t P, cpuResult & res)
+{
+	const uint32_t nstep = (sd.wstep) ? sd.wstep : sd.nstep;
+	const uint32_t lastN = (uint32_t)sd.lastN;
+	uint64_t Ps, k0, lk;
+
+	sieve_setup(sd, P, Ps, k0, lk);
+
+	uint32_t n = sd.nmin;
+
+	do {
+		test_k(sd, P, k0, n, nstep, res);
+
+		// Proceed to the K for the next N.
+		uint32_t s = (lastN - n < nstep) ? lastN - n : nstep;
+		n += s;
+		k0 = shiftmod_REDC(k0, P, k0*Ps, 64 - s, s);
+
+	} while (n < lastN);
+
+	sieve_check(P, k0, lk, res);
+}
+
+
+#if defined(ENABLE_MULTIARCH_SIMD)
+
+// runtime check for the widest usable vector unit: 2 = AVX-512, 1 = AVX2, 0 = none
+static int cpu_simd_level()
+{
+	int abcd[4];
+
+	run_cpuid(0, 0, abcd);
+	if (abcd[0] < 7)
+		return 0;
+
+	run_cpuid(1, 0, abcd);
+
+	// Ensure OS supports extended processor state management
+	if ((abcd[2] & (1 << 27)) == 0)
+		return 0;
+
+	int xcr0;
+	__asm__ ("xgetbv" : "=a" (xcr0) : "c" (0) : "%edx" );
+
+	// Check AVX OS support, SSE | YMM
+	if ((xcr0 & 0x06) != 0x06)
+		return 0;
+
+	run_cpuid(7, 0, abcd);
+
+	// AVX512F, and AVX512 OS support SSE | YMM | ZMM
+	if ((abcd[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+		return 2;
+
+	// AVX2
+	if (abcd[1] & (1 << 5))
+		return 1;
+
+	return 0;
+}
+
+
+// FMA3, for the FP64 sieve.  only asked once AVX2 is known to be usable.
+static bool cpu_has_fma()
+{
+	int abcd[4];
+
+	run_cpuid(1, 0, abcd);
+
+	return (abcd[2] & (1 << 12)) != 0;
+}
+
+
+// Sieve 4 primes at once with shiftmod_REDCsm / shiftmod_REDC32 in each 64 bit lane.
+// For nstep <= 32 the reduction only needs 32x32 bit products, so vpmuludq does all the work.
+__attribute__ ((target ("avx2")))
+static void sieve_primes_avx2(const searchData & sd, const uint64_t * P, cpuResult & res)
+{
+	uint64_t Ps[4], K[4], lK[4];
+
+	for(int j = 0; j < 4; ++j){
+		sieve_setup(sd, P[j], Ps[j], K[j], lK[j]);
+	}
+
+	const __m256i vP = _mm256_loadu_si256((const __m256i *)P);
+	const __m256i vPh = _mm256_srli_epi64(vP, 32);
+	const __m256i vPs = _mm256_loadu_si256((const __m256i *)Ps);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi64x(1);
+	const __m256i lo32 = _mm256_set1_epi64x(0xFFFFFFFF);
+	const __m256i nmask = _mm256_set1_epi64x((2ULL << sd.nstep) - 1);
+	const __m128i sh_n = _mm_cvtsi32_si128(sd.nstep);
+	const __m128i sh_m = _mm_cvtsi32_si128(32 - sd.nstep);
+
+	__m256i k = _mm256_loadu_si256((const __m256i *)K);
+	uint32_t n = sd.nmin;
+
+	do {
+		// Select the even one.
+		__m256i odd = _mm256_cmpeq_epi64(_mm256_and_si256(k, one), one);
+		__m256i kpos = _mm256_blendv_epi8(k, _mm256_sub_epi64(vP, k), odd);
+
+		// a lane can hold a factor only if 2^i | kpos with i <= nstep and kpos >> i < 2^32
+		__m256i lowbit = _mm256_and_si256(kpos, _mm256_sub_epi64(zero, kpos));
+		__m256i fits = _mm256_cmpgt_epi64(lowbit, _mm256_srli_epi64(kpos, 32));
+		__m256i outside = _mm256_cmpeq_epi64(_mm256_and_si256(kpos, nmask), zero);
+		int hit = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_andnot_si256(outside, fits)));
+
+		if(hit){
+			_mm256_storeu_si256((__m256i *)K, k);
+			for(int j = 0; j < 4; ++j){
+				if(hit & (1 << j)){
+					test_k(sd, P[j], K[j], n, sd.nstep, res);
+				}
+			}
+		}
+
+		// Proceed to the K for the next N.
+		n += sd.nstep;
+
+		__m256i rax = _mm256_and_si256(_mm256_sll_epi64(_mm256_mul_epu32(k, vPs), sh_m), lo32);
+		__m256i rcx = _mm256_srl_epi64(k, sh_n);
+		rcx = _mm256_add_epi64(rcx, _mm256_srli_epi64(_mm256_mul_epu32(rax, vP), 32));
+		rcx = _mm256_add_epi64(rcx, _mm256_mul_epu32(rax, vPh));
+		// if rax != 0, increase rcx
+		rcx = _mm256_add_epi64(rcx, _mm256_add_epi64(one, _mm256_cmpeq_epi64(rax, zero)));
+		// values are < 2^63 so the signed compare is fine
+		k = _mm256_sub_epi64(rcx, _mm256_and_si256(vP, _mm256_cmpgt_epi64(rcx, vP)));
+
+	} while (n < sd.nmax);
+
+	_mm256_storeu_si256((__m256i *)K, k);
+
+	for(int j = 0; j < 4; ++j){
+		sieve_check(P[j], K[j], lK[j], res);
+	}
+}
+
+
+// Same as above, 8 primes at once.
+// GCC 12's avx512fintrin.h fills the unmasked intrinsics' pass-through operand with an undefined vector,
+// which -Wall reports as used uninitialized.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__ ((target ("avx512f")))
+static void sieve_primes_avx512(const searchData & sd, const uint64_t * P, cpuResult & res)
+{
+	uint64_t Ps[8], K[8], lK[8];
+
+	for(int j = 0; j < 8; ++j){
+		sieve_setup(sd, P[j], Ps[j], K[j], lK[j]);
+	}
+
+	const __m512i vP = _mm512_loadu_si512((const void *)P);
+	const __m512i vPh = _mm512_srli_epi64(vP, 32);
+	const __m512i vPs = _mm512_loadu_si512((const void *)Ps);
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i one = _mm512_set1_epi64(1);
+	const __m512i lo32 = _mm512_set1_epi64(0xFFFFFFFF);
+	const __m512i nmask = _mm512_set1_epi64((2ULL << sd.nstep) - 1);
+	const __m128i sh_n = _mm_cvtsi32_si128(sd.nstep);
+	const __m128i sh_m = _mm_cvtsi32_si128(32 - sd.nstep);
+
+	__m512i k = _mm512_loadu_si512((const void *)K);
+	uint32_t n = sd.nmin;
+
+	do {
+		// Select the even one.
+		__m512i kpos = _mm512_mask_sub_epi64(k, _mm512_test_epi64_mask(k, one), vP, k);
+
+		// a lane can hold a factor only if 2^i | kpos with i <= nstep and kpos >> i < 2^32
+		__m512i lowbit = _mm512_and_si512(kpos, _mm512_sub_epi64(zero, kpos));
+		__mmask8 hit = _mm512_cmpgt_epu64_mask(lowbit, _mm512_srli_epi64(kpos, 32)) & _mm512_test_epi64_mask(kpos, nmask);
+
+		if(hit){
+			_mm512_storeu_si512((void *)K, k);
+			for(int j = 0; j < 8; ++j){
+				if(hit & (1 << j)){
+					test_k(sd, P[j], K[j], n, sd.nstep, res);
+				}
+			}
+		}
+
+		// Proceed to the K for the next N.
+		n += sd.nstep;
+
+		__m512i rax = _mm512_and_si512(_mm512_sll_epi64(_mm512_mul_epu32(k, vPs), sh_m), lo32);
+		__m512i rcx = _mm512_srl_epi64(k, sh_n);
+		rcx = _mm512_add_epi64(rcx, _mm512_srli_epi64(_mm512_mul_epu32(rax, vP), 32));
+		rcx = _mm512_add_epi64(rcx, _mm512_mul_epu32(rax, vPh));
+		// if rax != 0, increase rcx
+		rcx = _mm512_mask_add_epi64(rcx, _mm512_test_epi64_mask(rax, rax), rcx, one);
+		k = _mm512_mask_sub_epi64(rcx, _mm512_cmpgt_epu64_mask(rcx, vP), rcx, vP);
+
+	} while (n < sd.nmax);
+
+	_mm512_storeu_si512((void *)K, k);
+
+	for(int j = 0; j < 8; ++j){
+		sieve_check(P[j], K[j], lK[j], res);
+	}
+}
+#pragma GCC diagnostic pop
+
+
+
+// For p < 2^50, 4 primes at once with K in doubles, multiplied by c = 2^-step mod P each step like
+// sievefp.  Steps the full wstep, then one short integer step to land on lastN.
+__attribute__ ((target ("avx2,fma")))
+static void sieve_primes_fma(const searchData & sd, const uint64_t * P, cpuResult & res)
+{
+	const uint32_t step = (sd.wstep) ? sd.wstep : sd.nstep;
+	const uint32_t lastN = (uint32_t)sd.lastN;
+	uint64_t Ps[4], K[4], lK[4];
+	double dP[4], dK[4], c[4];
+
+	for(int j = 0; j < 4; ++j){
+		sieve_setup(sd, P[j], Ps[j], K[j], lK[j]);
+		dP[j] = (double)P[j];
+		dK[j] = (double)K[j];
+		c[j] = (double)shiftmod_REDC(1, P[j], Ps[j], 64 - step, step);
+	}
+
+	const __m256i vPi = _mm256_loadu_si256((const __m256i *)P);
+	const __m256d vP = _mm256_loadu_pd(dP);
+	const __m256d vPinv = _mm256_div_pd(_mm256_set1_pd(1.0), vP);
+	const __m256d vc = _mm256_loadu_pd(c);
+	const __m256d magic = _mm256_set1_pd(4503599627370496.0);	// 2^52
+	const __m256d dzero = _mm256_setzero_pd();
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi64x(1);
+	const __m256i nmask = _mm256_set1_epi64x((2ULL << step) - 1);
+
+	__m256d k = _mm256_loadu_pd(dK);
+	uint32_t n = sd.nmin;
+
+	for(; n + step <= lastN; n += step){
+		// K as integers, exact below 2^52
+		__m256i ki = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(k, magic)), _mm256_castpd_si256(magic));
+
+		// Select the even one.
+		__m256i odd = _mm256_cmpeq_epi64(_mm256_and_si256(ki, one), one);
+		__m256i kpos = _mm256_blendv_epi8(ki, _mm256_sub_epi64(vPi, ki), odd);
+
+		// a lane can hold a factor only if 2^i | kpos with i <= step and kpos >> i < 2^32
+		__m256i lowbit = _mm256_and_si256(kpos, _mm256_sub_epi64(zero, kpos));
+		__m256i fits = _mm256_cmpgt_epi64(lowbit, _mm256_srli_epi64(kpos, 32));
+		__m256i outside = _mm256_cmpeq_epi64(_mm256_and_si256(kpos, nmask), zero);
+		int hit = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_andnot_si256(outside, fits)));
+
+		if(hit){
+			_mm256_storeu_si256((__m256i *)K, ki);
+			for(int j = 0; j < 4; ++j){
+				if(hit & (1 << j)){
+					test_k(sd, P[j], K[j], n, step, res);
+				}
+			}
+		}
+
+		// Proceed to the K for the next N.  h + l is the exact product, q is within one of the quotient.
+		__m256d h = _mm256_mul_pd(k, vc);
+		__m256d l = _mm256_fmsub_pd(k, vc, h);
+		__m256d q = _mm256_round_pd(_mm256_mul_pd(h, vPinv), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		__m256d r = _mm256_add_pd(_mm256_fnmadd_pd(q, vP, h), l);
+		k = _mm256_add_pd(r, _mm256_and_pd(vP, _mm256_cmp_pd(r, dzero, _CMP_LT_OQ)));
+	}
+
+	_mm256_storeu_pd(dK, k);
+
+	for(int j = 0; j < 4; ++j){
+		K[j] = (uint64_t)dK[j];
+
+		// one short step to land on lastN
+		if(n < lastN){
+			uint32_t s = lastN - n;
+			test_k(sd, P[j], K[j], n, step, res);
+			K[j] = shiftmod_REDC(K[j], P[j], K[j]*Ps[j], 64 - s, s);
+		}
+
+		sieve_check(P[j], K[j], lK[j], res);
+	}
+}
+
+
+// time the FP64 sieve against the integer vector sieve on a few odd numbers near pmin, over part
+// of the N range.  true if the FP64 one is faster.
+static bool fma_faster(const searchData & sd, int simd)
+{
+	searchData bench = sd;
+	cpuResult scratch;
+	uint64_t P[8];
+
+	// about 2^16 steps of 32 each
+	if(bench.nmax - bench.nmin > (32u << 16)){
+		bench.nmax = bench.nmin + (32u << 16);
+	}
+	bench.lastN = bench.nmin + ((bench.nmax - bench.nmin + bench.nstep - 1) / bench.nstep) * bench.nstep;
+
+	for(int j = 0; j < 8; ++j){
+		P[j] = (sd.pmin | 1) + 2*j;
+	}
+
+	auto t0 = chrono::steady_clock::now();
+	if(simd == 2){
+		sieve_primes_avx512(bench, P, scratch);
+	}
+	else{
+		sieve_primes_avx2(bench, P, scratch);
+		sieve_primes_avx2(bench, P + 4, scratch);
+	}
+	auto t1 = chrono::steady_clock::now();
+	sieve_primes_fma(bench, P, scratch);
+	sieve_primes_fma(bench, P + 4, scratch);
+	auto t2 = chrono::steady_clock::now();
+
+	return (t2 - t1) < (t1 - t0);
+}
+#endif
+
+
+// generate the primes of [low, high) the same way the GPU generator for the workunit does, then sieve
+// them in groups of 'lanes' on the vector unit, any left over one at a time.  simd 3 is the FP64 sieve.
+// sieve is scratch space of at least (high-low)/2+1 bytes.
+static void sieve_segment(const searchData & sd, uint64_t low, uint64_t high, int simd, vector<uint8_t> & sieve, cpuResult & res)
+{
+	uint64_t batch[8];
+	int lanes = (simd == 2) ? 8 : (simd != 0) ? 4 : 1;
+	int cnt = 0;
+
+	// true primes where the GPU uses the Eratosthenes generator, base 2 strong probable primes elsewhere
+	bool exact = eratoRange(sd);
+
+	uint64_t first = low | 1;
+
+	if(first >= high) return;
+
+	uint64_t count = (high - first + 1) / 2;
+
+	memset(sieve.data(), 0, count);
+
+	// cross off odd multiples of the presieve primes
+	for(int j = 0; j < presieve_count; ++j){
+		uint64_t q = presieve_primes[j];
+		uint64_t m = ((first + q - 1) / q) * q;
+		if((m & 1) == 0) m += q;
+		for(uint64_t x = (m - first) / 2; x < count; x += q){
+			sieve[x] = 1;
+		}
+	}
+
+	for(uint64_t x = 0; x < count; ++x){
+		if(sieve[x] == 0){
+			uint64_t N = first + 2*x;
+			if( strong_prp_two(N) && (!exact || sprp_two_is_prime(N)) ){
+				batch[cnt++] = N;
+				if(cnt == lanes){
+					cnt = 0;
+#if defined(ENABLE_MULTIARCH_SIMD)
+					if(simd == 3){
+						sieve_primes_fma(sd, batch, res);
+						continue;
+					}
+					if(simd == 2){
+						sieve_primes_avx512(sd, batch, res);
+						continue;
+					}
+					if(simd == 1){
+						sieve_primes_avx2(sd, batch, res);
+						continue;
+					}
+#endif
+					sieve_prime(sd, N, res);
+				}
+			}
+		}
+	}
+
+	for(int j = 0; j < cnt; ++j){
+		sieve_prime(sd, batch[j], res);
+	}
+}
+
+
+// add segment results to the totals since the last checkpoint
+static void mergeResult( cpuResult & total, cpuResult & seg ){
+
+	total.checksum += seg.checksum;
+	total.primecount += seg.primecount;
+	total.flag |= seg.flag;
+	total.factorP.insert( total.factorP.end(), seg.factorP.begin(), seg.factorP.end() );
+	total.factorKN.insert( total.factorKN.end(), seg.factorKN.begin(), seg.factorKN.end() );
+
+	seg.checksum = 0;
+	seg.primecount = 0;
+	seg.flag = 0;
+	seg.factorP.clear();
+	seg.factorKN.clear();
+}
+
+
+static void cpu_getResults( cpuResult & res, searchData & sd ){
+
+	sd.primecount += res.primecount;
+	sd.checksum += res.checksum;
+
+	// flag set if there is an internal checksum error
+	if(res.flag > 0){
+		fprintf(stderr,"error: cpu checksum failure\n");
+		printf("error: cpu checksum failure\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(res.factorP.size() > 0){
+		processFactors(sd, (uint32_t)res.factorP.size(), res.factorP.data(), res.factorKN.data());
+	}
+
+	res.checksum = 0;
+	res.primecount = 0;
+	res.factorP.clear();
+	res.factorKN.clear();
+}
+
+
+void cpu_sieve( searchData & sd ){
+
+	time_t boinc_last, boinc_curr;
+	time_t ckpt_curr, ckpt_last;
+
+	sieve_small_primes(11);
+
+	// setup kernel parameters
+	setupSearch(sd);
+
+	fprintf(stderr, "Starting sieve at p: %" PRIu64 " n: %u k: %u\nStopping sieve at P: %" PRIu64 " N: %u K: %u\n", sd.pmin, sd.nmin+1, sd.kmin, sd.pmax, sd.nmax, sd.kmax);
+	if(boinc_is_standalone()){
+		printf("Starting sieve at p: %" PRIu64 " n: %u k: %u\nStopping sieve at P: %" PRIu64 " N: %u K: %u\n", sd.pmin, sd.nmin+1, sd.kmin, sd.pmax, sd.nmax, sd.kmax);
+	}
+
+	uint32_t nthreads = sd.threads;
+	if(nthreads == 0){
+		nthreads = thread::hardware_concurrency();
+	}
+	if(nthreads < 1){
+		nthreads = 1;
+	}
+
+	// vector unit for the sieve loop.  the 32 bit lane arithmetic needs nstep <= 32
+	int simd = 0;
+#if defined(ENABLE_MULTIARCH_SIMD)
+	if(sd.nstep <= 32){
+		simd = cpu_simd_level();
+	}
+#endif
+	if((int)sd.simd < simd){
+		simd = sd.simd;
+	}
+
+	// p < 2^50 with FMA, the FP64 sieve if it's faster here, or always with -S 4
+#if defined(ENABLE_MULTIARCH_SIMD)
+	if(simd > 0 && sd.simd >= 3){
+		sd.fp64 = cpu_has_fma();
+		if(fp64Forced(sd) || (fp64Range(sd) && fma_faster(sd, simd))){
+			simd = 3;
+		}
+	}
+#endif
+
+	// resume from checkpoint or clear the results file
+	loadState( &sd );
+
+	// size segments so each one is about 2^28 modular steps.  primes are about 1/ln(p) dense.
+	uint64_t steps = (sd.nmax - sd.nmin) / sd.nstep + 1;
+	double seg_d = ldexp(1.0, 28) / (double)steps * log((double)sd.p);
+	uint64_t segment = (seg_d > (double)(1u<<24)) ? (1u<<24) : (uint64_t)seg_d;
+	if(segment < (1u<<12)){
+		segment = 1u<<12;
+	}
+
+	// several segments per thread for load balance
+	uint32_t numsegments = nthreads * 8;
+	uint64_t range = segment * numsegments;
+
+	vector< vector<uint8_t> > scratch(nthreads, vector<uint8_t>(segment/2 + 1));
+	vector<cpuResult> segres(numsegments);
+	cpuResult pending;
+
+	// the calling thread is the last of nthreads
+	workPool pool(nthreads - 1);
+
+	const char * simd_name[] = { "scalar", "AVX2", "AVX-512", "FP64 FMA" };
+
+	fprintf(stderr,"Starting search on %u CPU threads, %s sieve...\n", nthreads, simd_name[simd]);
+	if(boinc_is_standalone()){
+		printf("Starting search on %u CPU threads, %s sieve...\n", nthreads, simd_name[simd]);
+	}
+
+	time(&boinc_last);
+	time(&ckpt_last);
+
+	printf("nstep: %u\n",sd.nstep);
+
+	time_t totals, totalf;
+	if(boinc_is_standalone()){
+		time(&totals);
+	}
+
+	// main search loop
+	for(uint64_t stop; sd.p < sd.pmax; sd.p += range){
+
+		stop = sd.p + range;
+		if(stop > sd.pmax) stop = sd.pmax;
+
+		// update BOINC fraction done every 2 sec
+		time(&boinc_curr);
+		if( ((int)boinc_curr - (int)boinc_last) > 1 ){
+    			double fd = (double)(sd.p-sd.pmin)/(double)(sd.pmax-sd.pmin);
+			boinc_fraction_done(fd);
+			if(boinc_is_standalone()) printf("Tests done: %.1f%%\n",fd*100.0);
+			boinc_last = boinc_curr;
+		}
+
+		// 1 minute checkpoint
+		time(&ckpt_curr);
+		if( ((int)ckpt_curr - (int)ckpt_last) > 60 ){
+			boinc_begin_critical_section();
+			cpu_getResults(pending, sd);
+			checkpoint(&sd);
+			boinc_end_critical_section();
+			ckpt_last = ckpt_curr;
+		}
+
+		uint64_t low = sd.p;
+		uint32_t segs = (uint32_t)((stop - low + segment - 1) / segment);
+
+		pool.run(segs, [&](uint32_t i, uint32_t tid){
+			uint64_t seglow = low + i * segment;
+			uint64_t seghigh = seglow + segment;
+			if(seghigh > stop) seghigh = stop;
+			sieve_segment(sd, seglow, seghigh, simd, scratch[tid], segres[i]);
+		});
+
+		// merge in segment order so factor order doesn't depend on thread timing
+		for(uint32_t i = 0; i < segs; ++i){
+			mergeResult(pending, segres[i]);
+		}
+
+	}
+
+
+	// final checkpoint
+	boinc_begin_critical_section();
+	sd.p = sd.pmax;
+	boinc_fraction_done(1.0);
+	if(boinc_is_standalone()) printf("Tests done: %.1f%%\n",100.0);
+	cpu_getResults(pending, sd);
+	checkpoint(&sd);
+
+	// print checksum
+	reportChecksum( &sd );
+
+	boinc_end_critical_section();
+
+
+	fprintf(stderr,"Search complete.\nfactors %" PRIu64 ", prime count %" PRIu64 "\n", sd.factorcount, sd.primecount);
+
+	if(boinc_is_standalone()){
+		time(&totalf);
+		printf("Search finished in %d sec.\n", (int)totalf - (int)totals);
+		printf("factors %" PRIu64 ", prime count %" PRIu64 ", checksum %016" PRIX64 "\n", sd.factorcount, sd.primecount, sd.checksum);
+	}
+
+
+	small_primes_free();
+}
@@ -0,0 +1,3 @@
+// cpu_sieve.h
+
+void cpu_sieve( searchData & sd );
@@ -0,0 +1,98 @@
+#!/usr/bin/perl
+# Generate the goodfactor small prime tables and filter, shared by the OpenCL sieve kernels and the CPU engine.
+# Usage: goodfactor.pl <limit> > kernels/goodfactor.cl
+# Tables cover the odd primes 3 <= q <= limit.  The host verifies factors against the primes from 11 up,
+# so 3, 5 and 7 are always filtered here and the reported factors don't depend on limit.
+use strict;
+
+my $args = @ARGV;
+
+if ($args != 1 || $ARGV[0] !~ /^\d+$/ || $ARGV[0] < 7 || $ARGV[0] > 509) {
+	print STDERR "usage: goodfactor.pl <limit>, 7 <= limit <= 509\n";
+	exit 1;
+}
+
+my $limit = $ARGV[0];
+
+# odd primes to limit
+my @composite;
+my @primes;
+for (my $n = 3; $n <= $limit; $n += 2) {
+	next if $composite[$n];
+	push @primes, $n;
+	for (my $m = $n * $n; $m <= $limit; $m += 2 * $n) {
+		$composite[$m] = 1;
+	}
+}
+
+my $count = @primes;
+
+# 2^n mod q repeats with the order of 2 mod q.  inv holds 2^-j mod q for j below the order,
+# so k*2^n+c is divisible by q when k == -c * inv[n mod order] mod q.
+my @order;
+my @offset;
+my @inv;
+foreach my $q (@primes) {
+	my $half = ($q + 1) / 2;	# 2^-1 mod q
+	my $x = 1;
+	push @offset, scalar(@inv);
+	do {
+		push @inv, $x;
+		$x = ($x * $half) % $q;
+	} while ($x != 1);
+	push @order, scalar(@inv) - $offset[-1];
+}
+
+my $entries = @inv;
+
+sub table {
+	my ($type, $name, @values) = @_;
+	my $n = @values;
+	my $out = "__constant $type $name\[$n\] = {\n";
+	for (my $i = 0; $i < @values; $i += 16) {
+		my $last = ($i + 16 >= @values) ? $#values : $i + 15;
+		$out .= "\t" . join(", ", @values[$i .. $last]) . (($last == $#values) ? "\n" : ",\n");
+	}
+	return $out . "};\n\n";
+}
+
+print <<EOF;
+/*
+
+	goodfactor tables
+
+	Generated by goodfactor.pl $limit, do not edit.
+
+	Included by the sieve kernels and by cpu_sieve.cpp, which defines __constant,
+	so it only uses types that mean the same in OpenCL C and C++.
+
+*/
+
+#define GOODFACTOR_PRIMES $count
+#define GOODFACTOR_LIMIT $primes[-1]
+
+EOF
+
+print table("unsigned short", "goodfactor_q", @primes);
+print table("unsigned short", "goodfactor_order", @order);
+print table("unsigned short", "goodfactor_offset", @offset);
+print table("unsigned short", "goodfactor_inv", @inv);
+
+print <<EOF;
+// Check that k*2^n+c is not divisible by a prime to GOODFACTOR_LIMIT, to minimize factors printed.
+// 32 bit remainders and a table lookup per prime.
+inline bool goodfactor(unsigned int k, unsigned int n, int c){
+
+	for(unsigned int i = 0; i < GOODFACTOR_PRIMES; ++i){
+		unsigned int q = goodfactor_q[i];
+		unsigned int inv = goodfactor_inv[goodfactor_offset[i] + n % goodfactor_order[i]];
+
+		if( k % q == ((c > 0) ? q - inv : inv) )
+			return false;
+	}
+
+	return true;
+
+}
+
+EOF
@@ -5,23 +5,24 @@
 	Bryan Little 2/12/2023
 
 	validates proper operation of the sieve kernel and notifies CPU if there was an error
-	also computes the checksum using a local memory reduction
+	also computes the checksum using a local memory reduction, and the batch stats of the control block
 
 */
 
 
-__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void check(__global ulong * g_K, __global ulong * g_lK, __global uint * g_flag, __global uint * primecount, __global ulong * g_P, __global ulong * g_checksum, uint numgroups) {
+__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void check(__global ulong * g_K, __global ulong * g_lK, __global uint * ctl, __global uint * primecount, __global uint * g_P, uint numgroups, const ulong base) {
 
 	uint gid = get_global_id(0);
 	uint lid = get_local_id(0);
 	__local ulong checksum[256];
 	uint pcnt = primecount[0];
+	__global ulong * g_checksum = (__global ulong *)(ctl + CTL_HEADER);
 
 	if(gid < pcnt){
 
 		ulong my_K = g_K[gid];
 		ulong last_K = g_lK[gid];
-		ulong my_P = g_P[gid];
+		ulong my_P = base + g_P[gid];
 
 		// add my_P and my_K to local memory
 		checksum[lid] = my_P + my_K;
@@ -30,7 +31,7 @@ __kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void check(__global u
 		if(my_K != last_K){
 			// printf("n %u bbits1 %d r1 %llu checksum mismatch %llu vs %llu\n",my_lastN,bbits1,r1,my_K,kpos);
 			// checksum mismatch, set flag
-			atomic_or(&g_flag[0], 1);
+			atomic_or(&ctl[CTL_FLAG], 1);
 		}
 	}
 	else{
@@ -62,9 +63,16 @@ __kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void check(__global u
 		g_checksum[0] += pcnt;
 
 		// store largest kernel prime count
-		if( pcnt > primecount[1] ){
-			primecount[1] = pcnt;
+		if( pcnt > ctl[CTL_MAXPRIMES] ){
+			ctl[CTL_MAXPRIMES] = pcnt;
 		}
+
+		// the sieve of this batch is done, its factors are counted
+		uint fcnt = ctl[CTL_FACTORS];
+		ctl[CTL_BATCHES] += 1;
+		ctl[CTL_BATCH_PRIMES] = pcnt;
+		ctl[CTL_BATCH_FACTORS] = fcnt - ctl[CTL_PREV_FACTORS];
+		ctl[CTL_PREV_FACTORS] = fcnt;
 	}
 
 }
@@ -4,19 +4,19 @@
 
 	Bryan Little 2/12/2023
 
-	Clears results
+	Clears results, the control block of one result slot
 
 */
 
 
-__kernel void clearresult(__global uint *flag, __global uint *factorcount, __global ulong *checksum, __global uint *primecount, uint numgroups){
+__kernel void clearresult(__global uint *ctl, uint numgroups){
 
 	int i = get_global_id(0);
 
-	if(i == 0){
-		factorcount[0] = 0;	// # of factors found
-		flag[0] = 0;		// set to 1 if there is a gpu checksum error
-		primecount[1]=0;	// keep track of largest kernel prime count
+	__global ulong * checksum = (__global ulong *)(ctl + CTL_HEADER);
+
+	if(i < CTL_HEADER){
+		ctl[i] = 0;		// factor count, checksum error flag and batch stats, see control.cl
 	}
 
 	if(i < numgroups){
@@ -0,0 +1,32 @@
+/*
+
+	control block
+
+	One buffer per box and result slot holds every counter the host reads back,
+	so a batch's status comes back in one small transfer and a checkpoint's
+	results in one more.  A header of uint words, then the checksum array.
+
+	Only defines, cl_sieve.cpp includes it too.
+
+*/
+
+
+// factors found, it keeps counting past maxfactors.  word 0, so the sieve kernels take the block as factorCnt
+#define CTL_FACTORS 0
+// set if a K didn't match its lastK
+#define CTL_FLAG 1
+// largest prime count of a batch, checked against the prime array size
+#define CTL_MAXPRIMES 2
+// batches checked
+#define CTL_BATCHES 3
+// primes and factors of the last batch checked
+#define CTL_BATCH_PRIMES 4
+#define CTL_BATCH_FACTORS 5
+// factor count when the batch before it was checked
+#define CTL_PREV_FACTORS 6
+
+// header size in uints, even so the ulong checksums after it are aligned.
+// checksum 0 is the total prime count, 1 to numgroups-1 the work-group sums of P + K.
+#define CTL_HEADER 8
+
+
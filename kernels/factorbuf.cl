@@ -0,0 +1,63 @@
+/*
+
+	factor buffer helpers
+
+	The sieve kernels stage factors in local memory and copy them out with
+	one global atomic per work-group, instead of one per factor.
+	The count keeps going past maxfactors so the host can see the overflow,
+	only the stores are dropped.
+
+*/
+
+
+// factors a work-group can stage before spilling straight to global memory
+#define FACTOR_BUF 256
+
+
+// stage one factor.  past FACTOR_BUF it is written to the global arrays directly.
+inline void stage_factor(__local uint * l_cnt, __local long * l_P, __local uint2 * l_KN,
+			__global uint * factorCnt, __global long * factorP, __global uint2 * factorKN, const uint maxfactors, const long p, const uint2 kn)
+{
+	uint L = atomic_inc(l_cnt);
+
+	if(L < FACTOR_BUF){
+		l_P[L] = p;
+		l_KN[L] = kn;
+	}
+	else{
+		uint I = atomic_inc(&factorCnt[0]);
+		if(I < maxfactors){
+			factorP[I] = p;
+			factorKN[I] = kn;
+		}
+	}
+}
+
+
+// copy the staged factors to the global arrays.  every thread of the group must call it.
+inline void flush_factors(__local uint * l_cnt, __local uint * l_pos, __local long * l_P, __local uint2 * l_KN,
+			__global uint * factorCnt, __global long * factorP, __global uint2 * factorKN, const uint maxfactors)
+{
+	uint lid = get_local_id(0);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint nf = min(l_cnt[0], (uint)FACTOR_BUF);
+
+	if(lid == 0 && nf > 0){
+		l_pos[0] = atomic_add(&factorCnt[0], nf);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if(nf > 0){
+		nf = min(nf, (l_pos[0] < maxfactors) ? maxfactors - l_pos[0] : 0u);
+	}
+
+	for(uint i = lid; i < nf; i += get_local_size(0)){
+		factorP[l_pos[0] + i] = l_P[i];
+		factorKN[l_pos[0] + i] = l_KN[i];
+	}
+}
+
+
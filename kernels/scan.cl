@@ -0,0 +1,137 @@
+/*
+
+	scan kernels
+
+	Work-group prefix sums, and the scan and write passes of the prime generators.
+
+*/
+
+
+// population count.  popcount() is OpenCL 1.2
+inline uint bitcount(uint x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	x = (x + (x >> 4)) & 0x0F0F0F0F;
+
+	return (x * 0x01010101) >> 24;
+}
+
+
+// exclusive prefix sum of v over a 256 thread work-group, *total gets the sum of all v.
+// every thread must call it.  s is 256 uints of local scratch.
+inline uint group_scan(__local uint * s, const uint y, const uint v, uint * total)
+{
+	s[y] = v;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(uint d = 1; d < 256; d <<= 1){
+		uint t = (y >= d) ? s[y - d] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		s[y] += t;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	uint incl = s[y];
+	*total = s[255];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return incl - v;
+}
+
+
+
+
+// count trailing zeros
+// needed because ctz() is undefined in Nvidia and AMD's CL v1.1 implementation
+#ifndef __ctz
+#define __ctz(_X) \
+	31u - clz(_X & -_X)
+#endif
+
+
+// the prime generators run in three passes so primes land in ascending order without ordering the work-groups.
+// getsegprimes or segsieve leaves each group's primes as a bitmap in g_bits, bit j is the number (low|1) + 2*j,
+// and the group's count in g_count.  primescan turns the counts into offsets and primewrite writes the primes.
+
+// counts each thread sums before the work-group scan
+#define SCAN_SPAN 8
+
+// exclusive prefix sum of g_count[0] to g_count[ngroups-1] in place, in one work-group.
+// g_count[ngroups] and the batch's prime count get the total.
+__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void primescan(__global uint * g_count, const uint ngroups, __global uint * primecount){
+
+	__local uint scan[256];
+
+	uint y = get_local_id(0);
+	uint carry = 0;
+
+	for(uint i = 0; i < ngroups; i += 256 * SCAN_SPAN){
+
+		uint first = i + y * SCAN_SPAN;
+		uint n = 0;
+
+		for(uint j = first; j < first + SCAN_SPAN && j < ngroups; ++j){
+			n += g_count[j];
+		}
+
+		uint total;
+		uint pos = carry + group_scan(scan, y, n, &total);
+
+		for(uint j = first; j < first + SCAN_SPAN && j < ngroups; ++j){
+			uint c = g_count[j];
+			g_count[j] = pos;
+			pos += c;
+		}
+
+		carry += total;
+	}
+
+	if(y == 0){
+		g_count[ngroups] = carry;
+		primecount[0] = carry;
+	}
+}
+
+
+// write the primes of one generator work-group, gwords words of g_bits, at its scanned offset.
+// primes are offsets from low.  the words are cleared for segmark's next batch.
+__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void primewrite(const ulong low, const uint gwords, __global uint * g_bits,
+			__global uint * g_count, __global uint * g_prime FUSED_SETUP_ARGS){
+
+	__local uint scan[256];
+
+	uint y = get_local_id(0);
+	uint g = get_group_id(0);
+	uint goff = g_count[g];
+
+	// no primes, or the group was past the end of the batch
+	if(g_count[g + 1] == goff){
+		return;
+	}
+
+	// each thread takes consecutive words so primes come out in ascending order
+	uint wpt = gwords / 256;
+	uint w0 = g * gwords + y * wpt;
+	uint n = 0;
+
+	for(uint w = w0; w < w0 + wpt; ++w){
+		n += bitcount(g_bits[w]);
+	}
+
+	uint total;
+	uint pos = goff + group_scan(scan, y, n, &total);
+	uint first = (uint)((low | 1) - low);
+
+	for(uint w = w0; w < w0 + wpt; ++w){
+		uint word = g_bits[w];
+		g_bits[w] = 0;
+		while(word){
+			uint b = __ctz(word);
+			word &= word - 1;
+			uint off = first + 2 * (w * 32 + b);
+			FUSED_SETUP_PRIME(low + off, pos);
+			g_prime[pos++] = off;
+		}
+	}
+}
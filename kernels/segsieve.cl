@@ -0,0 +1,130 @@
+/*
+
+	segsieve kernels
+
+	Segmented sieve of Eratosthenes prime generator.  Used instead of getsegprimes for
+	pmax below 2^56, see eratoRange in cl_sieve.cpp, so no PRP is needed.
+
+	Only odd numbers are sieved, bit j of a batch is the number (low|1) + 2*j.  primewrite
+	writes the primes out and clears the bits for the next batch.
+
+*/
+
+
+// each work-group sieves SEG_WORDS*32 odd numbers in local memory
+// must match seg_words in cl_sieve.cpp
+#define SEG_WORDS 4096
+#define SEG_BITS (SEG_WORDS*32)
+
+
+// bit index of the first odd multiple of p that is >= start and >= p*p.  start is odd.
+inline ulong first_bit(const ulong start, const uint p)
+{
+	ulong pp = (ulong)p * p;
+
+	if(pp >= start){
+		return (pp - start) >> 1;
+	}
+
+	// start + 2j == 0 mod p
+	uint r = (uint)(start % p);
+	uint t = (r == 0) ? 0 : p - r;
+
+	return (t & 1) ? (t + p) >> 1 : t >> 1;
+}
+
+
+__kernel void segclear(__global uint * g_bits, const uint nwords){
+
+	uint gid = get_global_id(0);
+
+	if(gid < nwords){
+		g_bits[gid] = 0;
+	}
+}
+
+
+// mark the multiples of the large sieving primes g_sprimes[first] to g_sprimes[last-1] in g_bits, one prime per work-item.
+// these have at most a few multiples in each segment.
+__kernel void segmark(const ulong low, const ulong high, __global uint * g_sprimes, const uint first, const uint last, __global uint * g_bits){
+
+	uint gid = get_global_id(0) + first;
+
+	if(gid < last){
+		uint p = g_sprimes[gid];
+		ulong start = low | 1;
+		ulong nbits = (high - start + 1) >> 1;
+
+		for(ulong j = first_bit(start, p); j < nbits; j += p){
+			atomic_or(&g_bits[j >> 5], 1u << (j & 31));
+		}
+	}
+}
+
+
+// sieve one segment per work-group, the count pass of the prime generator, see primescan.  reads the segmark bits,
+// sieves the small primes g_sprimes[0] to g_sprimes[nsmall-1] in local memory, then leaves the numbers left as primes
+// in the segment's words of g_bits and their count in g_count.
+// the first ncoop small primes have more than 256 multiples per segment, so the whole group marks them together.
+__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void segsieve(const ulong low, const ulong high, __global uint * g_sprimes, const uint ncoop,
+			const uint nsmall, __global uint * g_bits, __global uint * g_count){
+
+	__local uint bits[SEG_WORDS];
+	__local uint scan[256];
+
+	uint y = get_local_id(0);
+	uint seg = get_group_id(0);
+	ulong start = (low | 1) + 2 * (ulong)seg * SEG_BITS;
+
+	// whole group is past the end of the batch
+	if(start >= high){
+		if(y == 0){
+			g_count[seg] = 0;
+		}
+		return;
+	}
+
+	__global uint * segbits = g_bits + (ulong)seg * SEG_WORDS;
+
+	for(uint w = y; w < SEG_WORDS; w += 256){
+		bits[w] = segbits[w];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(uint i = 0; i < ncoop; ++i){
+		uint p = g_sprimes[i];
+		ulong j = first_bit(start, p) + (ulong)y * p;
+		for(; j < SEG_BITS; j += 256 * p){
+			atomic_or(&bits[j >> 5], 1u << (j & 31));
+		}
+	}
+
+	for(uint i = ncoop + y; i < nsmall; i += 256){
+		uint p = g_sprimes[i];
+		for(ulong j = first_bit(start, p); j < SEG_BITS; j += p){
+			atomic_or(&bits[j >> 5], 1u << (j & 31));
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	ulong nbits = (high - start + 1) >> 1;
+	uint n = 0;
+
+	for(uint w = y; w < SEG_WORDS; w += 256){
+		uint word = ~bits[w];
+		ulong b0 = (ulong)w * 32;
+		// numbers >= high
+		if(b0 + 32 > nbits){
+			word = (b0 >= nbits) ? 0 : word & ((1u << (uint)(nbits - b0)) - 1);
+		}
+		segbits[w] = word;
+		n += bitcount(word);
+	}
+
+	uint total;
+	group_scan(scan, y, n, &total);
+
+	if(y == 0){
+		g_count[seg] = total;
+	}
+}
@@ -116,27 +116,46 @@ inline ulong invpowmod_REDClr (const ulong N, const ulong Ns, const ulong r0, co
 }
 
 
-// Set up to check N's by getting in position with division only.
-__kernel void setup(__global ulong * P, __global ulong * Ps, __global ulong * K, __global ulong * lK, const ulong r0, const int bbits, const uint nmin, const ulong r1, const int bbits1, const uint lastn, __global uint * primecount ) {
+// Ps, K and lK for one prime, used by setup and by the prime generators when FUSED_SETUP is defined.
+inline void setup_prime(const ulong my_P, const uint gid, __global ulong * Ps, __global ulong * K, __global ulong * lK, const ulong r0, const int bbits,
+			const uint nmin, const ulong r1, const int bbits1, const uint lastn ) {
 
-	uint gid = get_global_id(0);
+	ulong my_Ps = -invmod2pow_ul (my_P); // Ns = -N^{-1} % 2^64
 
-	if(gid < primecount[0]){
+	// Calculate k0, not in Montgomery form.
+	ulong k0 = invpowmod_REDClr(my_P, my_Ps, r0, bbits, nmin);
+
+	// calculate k for last value of N, for checksum.
+	ulong k1 = invpowmod_REDClr(my_P, my_Ps, r1, bbits1, lastn);
+
+	// store to global arrays
+	Ps[gid] = my_Ps;
+	K[gid] = k0;
+	lK[gid] = k1;
+
+}
 
-		ulong my_P = P[gid];
 
-		ulong my_Ps = -invmod2pow_ul (my_P); // Ns = -N^{-1} % 2^64
+// extra prime generator arguments when it also does the setup kernel's work, saving a kernel launch and a pass over the primes
+#ifdef FUSED_SETUP
+	#define FUSED_SETUP_ARGS , __global ulong * g_Ps, __global ulong * g_K, __global ulong * g_lK, const ulong r0, const int bbits, const uint nmin, \
+				const ulong r1, const int bbits1, const uint lastn
+	#define FUSED_SETUP_PRIME(P, gid) setup_prime(P, gid, g_Ps, g_K, g_lK, r0, bbits, nmin, r1, bbits1, lastn)
+#else
+	#define FUSED_SETUP_ARGS
+	#define FUSED_SETUP_PRIME(P, gid)
+#endif
 
-		// Calculate k0, not in Montgomery form.
-		ulong k0 = invpowmod_REDClr(my_P, my_Ps, r0, bbits, nmin);
 
-		// calculate k for last value of N, for checksum.
-		ulong k1 = invpowmod_REDClr(my_P, my_Ps, r1, bbits1, lastn);
+// Set up to check N's by getting in position with division only.
+// primes are stored as 32 bit offsets from base, the start of the batch.
+__kernel void setup(__global uint * P, __global ulong * Ps, __global ulong * K, __global ulong * lK, const ulong r0, const int bbits, const uint nmin, const ulong r1, const int bbits1, const uint lastn, __global uint * primecount, const ulong base ) {
+
+	uint gid = get_global_id(0);
+
+	if(gid < primecount[0]){
 
-		// store to global arrays
-		Ps[gid] = my_Ps;
-		K[gid] = k0;
-		lK[gid] = k1;
+		setup_prime(base + P[gid], gid, Ps, K, lK, r0, bbits, nmin, r1, bbits1, lastn);
 
 	}
 
@@ -15,38 +15,62 @@
 #define __ctz(_X) \
 	31u - clz(_X & -_X)
 
+// nstep, mont_nstep, nmax, kmin and kmax are fixed at build time with -D by the host, so the
+// compiler can fold the shifts and unroll the sieve loop.  Without them the kernel arguments are used.
+#ifndef NSTEP
+	#define NSTEP nstep
+#endif
+#ifndef MONT_NSTEP
+	#define MONT_NSTEP mont_nstep
+#endif
+#ifndef NMAX
+	#define NMAX nmax
+#endif
+#ifndef KMIN
+	#define KMIN kmin
+#endif
+#ifndef KMAX
+	#define KMAX kmax
+#endif
+
+#ifdef UNROLL
+	#define DO_PRAGMA(x) _Pragma(#x)
+	#define UNROLL_HINT(x) DO_PRAGMA(unroll x)
+	#define SIEVE_UNROLL UNROLL_HINT(UNROLL)
+#else
+	#define SIEVE_UNROLL
+#endif
 
-// 1 if a number mod 15 is not divisible by 2 or 3.
-//                           0  1  2  3  4  5  6  7  8  9 10 11 12 13 14
-__constant int prime15[] = { 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1 };
-
-inline bool goodfactor(uint uk, uint n, int c){
-
-	ulong k = uk;
-	ulong mod31;
-	// Check that K*2^N+/-1 is not divisible by 3, 5, or 7, to minimize factors printed.
-	// We do 3 and 5 at the same time (15 = 2^4-1), then 7 (=2^3-1).
-	// Then 17, 11 (and 31), 13, and maybe 19, if there's space. 23 can also go in there, if it's worth it.
-	// (k*(1<<(n%2))+c)%3 == 0
-	if(	prime15[(uint)(((k<<(n&3))+c)%15)] && 
-		(uint)(((k<<(n%3))+c)%7) != 0 &&
-		(uint)(((k<<(n&7))+c)%17) != 0 && 
-		(uint)((mod31=(k<<(n%10))+c)%11) != 0 &&
-		(uint)(((k<<(n%11))+c)%23) != 0 &&
-		(uint)(((k<<(n%12))+c)%13) != 0 &&
-		(uint)(((k<<(n%18))+c)%19) != 0 )
-		if( (uint)(mod31%31) != 0 )
-			return true;
-
-	return false;
+// The host includes this file once for each lane count, 1, 2 and 4.  Each work-item of the _x2 and _x4
+// kernels sieves that many primes, gid + j * global size for lane j, with their steps interleaved so
+// one prime's multiply latency is hidden behind the others.  The profiler picks the fastest.
+#ifndef LANES
+	#define LANES 1
+#endif
+#undef SIEVE_NAME
+#if LANES == 1
+	#define SIEVE_NAME(name) name
+#elif LANES == 2
+	#define SIEVE_NAME(name) name ## _x2
+#else
+	#define SIEVE_NAME(name) name ## _x4
+#endif
+#define LANE_LOOP _Pragma("unroll")
 
-}
+
+#ifndef SIEVE_HELPERS
+// goodfactor() comes from goodfactor.cl, generated by goodfactor.pl and built ahead of this file
 
 
-// For any nstep.  not as fast as the 32 and SM versions below
+// For nstep > 32, the wide kernel steps the full nstep.  The host passes it as the nstep arg
+// and -D WSTEP, NSTEP is 32 and the kernel still stops on that grid.
+#ifndef WSTEP
+	#define WSTEP nstep
+#endif
 
 // Compute T=a<<s; m = (T*Ns)%2^64; T += m*N; if (T>N) T-= N;
-// rax is passed in as a * Ns.
+// rax is passed in as a * Ns.  It needs the low nstep bits of the product, so for nstep > 32
+// it's the full 64x64 bit product, not the 32 bit one the other kernels use.
 inline ulong shiftmod_REDC (const ulong a, const ulong N, ulong rax, const uint mont_nstep, const uint nstep)
 {
 	ulong rcx;
@@ -65,80 +89,211 @@ inline ulong shiftmod_REDC (const ulong a, const ulong N, ulong rax, const uint
 }
 
 
-__kernel void sieve(__global ulong * g_P, __global ulong * g_Ps, __global ulong * g_K, __global uint * primecount, __global uint2 * factorKN, __global long * factorP,
+// the factor test of the wide and FP64 kernels, for k*2^(n+i)+/-1 with i <= step
+inline void test_wide(const ulong k0, const ulong P, const uint n, const uint l_nmax, const bool live, const uint step, const uint kmin, const uint kmax,
+			__local uint * l_cnt, __local long * l_P, __local uint2 * l_KN, __global uint * factorCnt, __global long * factorP, __global uint2 * factorKN, const uint maxfactors)
+{
+	// Select the even one.
+	ulong kpos = (((uint)k0) & 1)?(P - k0):k0;
+
+	uint i = (uint)(kpos);
+	i = (i != 0) ? __ctz(i) : __ctz((uint)(kpos >> 32)) + 32;
+
+	// if (kpos >> i) > 32 bits, k is larger than uint.
+	if(i <= step && (kpos >> i) <= 0xFFFFFFFFul){
+		uint the_k = (uint)(kpos >> i);
+		uint the_n = n + i;
+		if (the_k >= KMIN && the_k <= KMAX && the_n <= l_nmax){
+			int s = (kpos==k0)?-1:1;
+			if( live && goodfactor(the_k, the_n, s)){
+				stage_factor(l_cnt, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors, (s==1) ? (long)P : -((long)P), (uint2){ the_k, the_n });
+			}
+		}
+	}
+}
+#endif
+
+
+__kernel void SIEVE_NAME(sievewide)(__global uint * g_P, __global ulong * g_Ps, __global ulong * g_K, __global uint * primecount, __global uint2 * factorKN, __global long * factorP,
 			__global uint * factorCnt, const uint N, const uint nstep, const uint kernel_nstep, const uint mont_nstep, const uint nmax, const uint kmin,
-			const uint kmax) {
+			const uint kmax, const ulong base, const uint maxfactors) {
 
 	uint n = N;
-	ulong kpos;
-	uint i;
 	uint l_nmax = n + kernel_nstep;
-	if(l_nmax > nmax) l_nmax = nmax;
+	if(l_nmax > NMAX) l_nmax = NMAX;
+
+	// stop where sieve32 would, so K is at lastN after the last launch and the checksum is the same
+	uint l_end = N + max((l_nmax - N + 31) / 32, 1u) * 32;
 
 	uint gid = get_global_id(0);
+	uint pcnt = primecount[0];
 
-	if(gid < primecount[0]){
-		ulong Ps = g_Ps[gid];
-		ulong k0 = g_K[gid];
-		ulong my_P = g_P[gid];
-		uint Psh = (uint)Ps;
+	__local uint l_cnt, l_pos;
+	__local long l_P[FACTOR_BUF];
+	__local uint2 l_KN[FACTOR_BUF];
 
-		do {
-			// Select the even one.
-			kpos = (((uint)k0) & 1)?(my_P - k0):k0;
+	if(get_local_id(0) == 0) l_cnt = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-			i = (uint)(kpos);
-			if(i != 0){
-				i = __ctz(i);
-				if(i <= nstep){
-					if ((((uint)(kpos >> 32))>>i) == 0) {
-						uint the_k = (uint)(kpos >> i);
-						uint the_n = n + i;
-						if (the_k >= kmin && the_k <= kmax && the_n <= l_nmax){
-							int s = (kpos==k0)?-1:1;
-							if( goodfactor(the_k, the_n, s)){
-								int I = atomic_inc(&factorCnt[0]);
-								factorP[I] = (s==1) ? (long)my_P : -((long)my_P);
-								factorKN[I] = (uint2){ the_k, the_n };
-							}
-						}
-					}
-					// if (kpos >> 32))>>i > 0, k is larger than uint.
-				}
-			}
-			else {
-				// if this is called, we already know (uint)(kpos) == 0
-				// i is >= 32
-				i = (uint)(kpos>>32);
-				i = __ctz(i) + 32;
-				if(i <= nstep){
-					uint the_k = (uint)(kpos >> i);
-					uint the_n = n + i;
-					if (the_k >= kmin && the_k <= kmax && the_n <= l_nmax){
-						int s = (kpos==k0)?-1:1;
-						if( goodfactor(the_k, the_n, s)){
-							int I = atomic_inc(&factorCnt[0]);
-							factorP[I] = (s==1) ? (long)my_P : -((long)my_P);
-							factorKN[I] = (uint2){ the_k, the_n };
-						}
-					}
-				}
+	uint stride = get_global_size(0);
+
+	// one pass, or a grid-stride loop when the host launches fewer work-items than primes (persistent mode)
+	for(uint first = gid; first < pcnt; first += stride * LANES){
+		uint lanes = min( (uint)LANES, (pcnt - first + stride - 1) / stride );
+		ulong k0[LANES], my_P[LANES], Ps[LANES];
+
+		LANE_LOOP
+		for(uint j = 0; j < LANES; ++j){
+			uint idx = (j < lanes) ? first + j * stride : first;
+			k0[j] = g_K[idx];
+			my_P[j] = base + g_P[idx];
+			Ps[j] = g_Ps[idx];
+		}
+
+		n = N;
+
+		SIEVE_UNROLL
+		for(; n + WSTEP <= l_end; n += WSTEP){
+			LANE_LOOP
+			for(uint j = 0; j < LANES; ++j){
+				test_wide(k0[j], my_P[j], n, l_nmax, j < lanes, WSTEP, kmin, kmax, &l_cnt, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors);
+
+				// Proceed to the K for the next N.
+				k0[j] = shiftmod_REDC(k0[j], my_P[j], k0[j]*Ps[j], 64u - WSTEP, WSTEP);
 			}
+		}
 
-			// Proceed to the K for the next N.
-			n += nstep;
-			k0 = shiftmod_REDC(k0, my_P, ((uint)k0)*Psh, mont_nstep, nstep);
+		// one short step to land on l_end
+		if(n < l_end){
+			uint s = l_end - n;
 
-		} while (n < l_nmax);
+			LANE_LOOP
+			for(uint j = 0; j < LANES; ++j){
+				test_wide(k0[j], my_P[j], n, l_nmax, j < lanes, WSTEP, kmin, kmax, &l_cnt, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors);
+
+				k0[j] = shiftmod_REDC(k0[j], my_P[j], k0[j]*Ps[j], 64u - s, s);
+			}
+		}
 
 
-		g_K[gid] = k0;  // store k0 to global array
+		// store k0 to global array
+		LANE_LOOP
+		for(uint j = 0; j < LANES; ++j){
+			if(j < lanes){
+				g_K[first + j * stride] = k0[j];
+			}
+		}
 
 	}
 
+	flush_factors(&l_cnt, &l_pos, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors);
+
 }
 
 
+#ifdef FPSTEP
+#ifndef SIEVE_HELPERS
+// For p < 2^50 on devices with double precision, the host adds -D FPSTEP, the full step.
+// The FP64 kernel multiplies K by c = 2^-FPSTEP mod P each step, with doubles instead of
+// 64 bit integer Montgomery math, and stops on the NSTEP grid like the wide kernel.
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+// a*c mod P for a, c < P < 2^50.  h + l is the exact product, q is within one of the quotient.
+inline double mulmod_fp(const double a, const double c, const double P, const double Pinv)
+{
+	double h = a * c;
+	double l = fma(a, c, -h);
+	double q = rint(h * Pinv);
+	double r = fma(-q, P, h) + l;
+
+	return (r < 0.0) ? r + P : r;
+}
+#endif
+
+
+__kernel void SIEVE_NAME(sievefp)(__global uint * g_P, __global ulong * g_Ps, __global ulong * g_K, __global uint * primecount, __global uint2 * factorKN, __global long * factorP,
+			__global uint * factorCnt, const uint N, const uint nstep, const uint kernel_nstep, const uint mont_nstep, const uint nmax, const uint kmin,
+			const uint kmax, const ulong base, const uint maxfactors) {
+
+	uint n = N;
+	uint l_nmax = n + kernel_nstep;
+	if(l_nmax > NMAX) l_nmax = NMAX;
+
+	uint l_end = N + max((l_nmax - N + NSTEP - 1) / NSTEP, 1u) * NSTEP;
+
+	uint gid = get_global_id(0);
+	uint pcnt = primecount[0];
+
+	__local uint l_cnt, l_pos;
+	__local long l_P[FACTOR_BUF];
+	__local uint2 l_KN[FACTOR_BUF];
+
+	if(get_local_id(0) == 0) l_cnt = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint stride = get_global_size(0);
+
+	// one pass, or a grid-stride loop when the host launches fewer work-items than primes (persistent mode)
+	for(uint first = gid; first < pcnt; first += stride * LANES){
+		uint lanes = min( (uint)LANES, (pcnt - first + stride - 1) / stride );
+		ulong my_P[LANES], Ps[LANES];
+		double k0[LANES], dP[LANES], Pinv[LANES], c[LANES];
+
+		LANE_LOOP
+		for(uint j = 0; j < LANES; ++j){
+			uint idx = (j < lanes) ? first + j * stride : first;
+			my_P[j] = base + g_P[idx];
+			Ps[j] = g_Ps[idx];
+			k0[j] = (double)g_K[idx];
+			dP[j] = (double)my_P[j];
+			Pinv[j] = 1.0 / dP[j];
+			c[j] = (double)shiftmod_REDC(1, my_P[j], Ps[j], 64u - FPSTEP, FPSTEP);
+		}
+
+		n = N;
+
+		SIEVE_UNROLL
+		for(; n + FPSTEP <= l_end; n += FPSTEP){
+			LANE_LOOP
+			for(uint j = 0; j < LANES; ++j){
+				test_wide((ulong)k0[j], my_P[j], n, l_nmax, j < lanes, FPSTEP, kmin, kmax, &l_cnt, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors);
+
+				// Proceed to the K for the next N.
+				k0[j] = mulmod_fp(k0[j], c[j], dP[j], Pinv[j]);
+			}
+		}
+
+		// one short step to land on l_end, in integers
+		if(n < l_end){
+			uint s = l_end - n;
+
+			LANE_LOOP
+			for(uint j = 0; j < LANES; ++j){
+				ulong k = (ulong)k0[j];
+
+				test_wide(k, my_P[j], n, l_nmax, j < lanes, FPSTEP, kmin, kmax, &l_cnt, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors);
+
+				k0[j] = (double)shiftmod_REDC(k, my_P[j], k*Ps[j], 64u - s, s);
+			}
+		}
+
+
+		// store k0 to global array
+		LANE_LOOP
+		for(uint j = 0; j < LANES; ++j){
+			if(j < lanes){
+				g_K[first + j * stride] = (ulong)k0[j];
+			}
+		}
+
+	}
+
+	flush_factors(&l_cnt, &l_pos, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors);
+
+}
+#endif
+
+#ifndef SIEVE_HELPERS
 // For nstep == 32
 
 inline ulong mad_wide_u32 (const uint a, const uint b, ulong c) {
@@ -166,78 +321,110 @@ inline ulong shiftmod_REDC32 (ulong rcx, const ulong N, const uint rax)
 
 	return rcx;
 }
+#endif
 
 
-__kernel void sieve32(__global ulong * g_P, __global ulong * g_Ps, __global ulong * g_K, __global uint * primecount, __global uint2 * factorKN, __global long * factorP,
+__kernel void SIEVE_NAME(sieve32)(__global uint * g_P, __global ulong * g_Ps, __global ulong * g_K, __global uint * primecount, __global uint2 * factorKN, __global long * factorP,
 			__global uint * factorCnt, const uint N, const uint nstep, const uint kernel_nstep, const uint mont_nstep, const uint nmax, const uint kmin,
-			const uint kmax) {
+			const uint kmax, const ulong base, const uint maxfactors) {
 
 	uint i;
 	uint n = N;
 	ulong kpos;
 	uint l_nmax = n + kernel_nstep;
-	if(l_nmax > nmax) l_nmax = nmax;
+	if(l_nmax > NMAX) l_nmax = NMAX;
 
 	uint gid = get_global_id(0);
+	uint pcnt = primecount[0];
+
+	__local uint l_cnt, l_pos;
+	__local long l_P[FACTOR_BUF];
+	__local uint2 l_KN[FACTOR_BUF];
+
+	if(get_local_id(0) == 0) l_cnt = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint stride = get_global_size(0);
+
+	// one pass, or a grid-stride loop when the host launches fewer work-items than primes (persistent mode)
+	for(uint first = gid; first < pcnt; first += stride * LANES){
+		uint lanes = min( (uint)LANES, (pcnt - first + stride - 1) / stride );
+		ulong k0[LANES], my_P[LANES];
+		uint Psh[LANES];
 
-	if(gid < primecount[0]){
-		ulong Ps = g_Ps[gid];
-		ulong k0 = g_K[gid];
-		ulong my_P = g_P[gid];
-		uint Psh = (uint)Ps;
+		LANE_LOOP
+		for(uint j = 0; j < LANES; ++j){
+			uint idx = (j < lanes) ? first + j * stride : first;
+			k0[j] = g_K[idx];
+			my_P[j] = base + g_P[idx];
+			Psh[j] = (uint)g_Ps[idx];
+		}
 
+		n = N;
+
+		SIEVE_UNROLL
 		do {
-			// Select the even one.
-			kpos = (((uint)k0) & 1)?(my_P - k0):k0;
-
-			i = (uint)(kpos);
-			if(i != 0){
-				i = __ctz(i);
-				if ((((uint)(kpos >> 32))>>i) == 0) {
-					uint the_k = (uint)(kpos >> i);
-					uint the_n = n + i;
-					if (the_k >= kmin && the_k <= kmax && the_n <= l_nmax){
-						int s = (kpos==k0)?-1:1;
-						if( goodfactor(the_k, the_n, s)){
-							int I = atomic_inc(&factorCnt[0]);
-							factorP[I] = (s==1) ? (long)my_P : -((long)my_P);
-							factorKN[I] = (uint2){ the_k, the_n };
+			LANE_LOOP
+			for(uint j = 0; j < LANES; ++j){
+				// Select the even one.
+				kpos = (((uint)k0[j]) & 1)?(my_P[j] - k0[j]):k0[j];
+
+				i = (uint)(kpos);
+				if(i != 0){
+					i = __ctz(i);
+					if ((((uint)(kpos >> 32))>>i) == 0) {
+						uint the_k = (uint)(kpos >> i);
+						uint the_n = n + i;
+						if (the_k >= KMIN && the_k <= KMAX && the_n <= l_nmax){
+							int s = (kpos==k0[j])?-1:1;
+							if( j < lanes && goodfactor(the_k, the_n, s)){
+								stage_factor(&l_cnt, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors, (s==1) ? (long)my_P[j] : -((long)my_P[j]), (uint2){ the_k, the_n });
+							}
 						}
 					}
+					// if (kpos >> 32))>>i > 0, k is larger than uint.
 				}
-				// if (kpos >> 32))>>i > 0, k is larger than uint.
-			}
-			else {
-				// if this is called, we already know (uint)(kpos) == 0
-				// i is >= 32, and has to be 32 for this kernel
-				uint the_k = (uint)(kpos>>32);
-				i = __ctz(the_k) + 32;
-				if(i == 32){
-					uint the_n = n + 32;
-					if (the_k >= kmin && the_k <= kmax && the_n <= l_nmax){
-						int s = (kpos==k0)?-1:1;
-						if( goodfactor(the_k, the_n, s)){
-							int I = atomic_inc(&factorCnt[0]);
-							factorP[I] = (s==1) ? (long)my_P : -((long)my_P);
-							factorKN[I] = (uint2){ the_k, the_n };
+				else {
+					// if this is called, we already know (uint)(kpos) == 0
+					// i is >= 32, and has to be 32 for this kernel
+					uint the_k = (uint)(kpos>>32);
+					i = __ctz(the_k) + 32;
+					if(i == 32){
+						uint the_n = n + 32;
+						if (the_k >= KMIN && the_k <= KMAX && the_n <= l_nmax){
+							int s = (kpos==k0[j])?-1:1;
+							if( j < lanes && goodfactor(the_k, the_n, s)){
+								stage_factor(&l_cnt, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors, (s==1) ? (long)my_P[j] : -((long)my_P[j]), (uint2){ the_k, the_n });
+							}
 						}
 					}
 				}
+
+				// Proceed to the K for the next N.
+				k0[j] = shiftmod_REDC32(k0[j], my_P[j], ((uint)k0[j]) * Psh[j]);
 			}
 
 			n += 32;
-			k0 = shiftmod_REDC32(k0, my_P, ((uint)k0) * Psh);
 
 		} while (n < l_nmax);
 
 
-		g_K[gid] = k0;  // store k0 to global array
+		// store k0 to global array
+		LANE_LOOP
+		for(uint j = 0; j < LANES; ++j){
+			if(j < lanes){
+				g_K[first + j * stride] = k0[j];
+			}
+		}
 
 	}
 
+	flush_factors(&l_cnt, &l_pos, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors);
+
 }
 
 
+#ifndef SIEVE_HELPERS
 // For nstep < 32
 
 // Multiply two 32-bit integers to get a 64-bit result.
@@ -269,65 +456,98 @@ inline ulong shiftmod_REDCsm (ulong rcx, const ulong N, uint rax, const uint sm_
 	rcx = (rcx>N)?(rcx-N):rcx;
 	return rcx;
 }
+#endif
 
 
-__kernel void sievesm(__global ulong * g_P, __global ulong * g_Ps, __global ulong * g_K, __global uint * primecount, __global uint2 * factorKN, __global long * factorP,
+__kernel void SIEVE_NAME(sievesm)(__global uint * g_P, __global ulong * g_Ps, __global ulong * g_K, __global uint * primecount, __global uint2 * factorKN, __global long * factorP,
 			__global uint * factorCnt, const uint N, const uint nstep, const uint kernel_nstep, const uint mont_nstep, const uint nmax, const uint kmin,
-			const uint kmax) {
+			const uint kmax, const ulong base, const uint maxfactors) {
 
 	uint n = N;
 	ulong kpos;
 	uint i;
-	const uint sm_mont_nstep = mont_nstep - 32;
+	const uint sm_mont_nstep = MONT_NSTEP - 32;
 	uint l_nmax = n + kernel_nstep;
-	if(l_nmax > nmax) l_nmax = nmax;
+	if(l_nmax > NMAX) l_nmax = NMAX;
 
 	uint gid = get_global_id(0);
+	uint pcnt = primecount[0];
 
-	if(gid < primecount[0]){
-		ulong Ps = g_Ps[gid];
-		ulong k0 = g_K[gid];
-		ulong my_P = g_P[gid];
-		uint Psh = (uint)Ps;
+	__local uint l_cnt, l_pos;
+	__local long l_P[FACTOR_BUF];
+	__local uint2 l_KN[FACTOR_BUF];
 
-		do {
-			// Select the even one.
-			kpos = (((uint)k0) & 1)?(my_P - k0):k0;
+	if(get_local_id(0) == 0) l_cnt = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-			i = (uint)(kpos);
-			if(i != 0){
-				i = __ctz(i);
-				if(i <= nstep){
-					if ((((uint)(kpos >> 32))>>i) == 0) {
-						uint the_k = (uint)(kpos >> i);
-						uint the_n = n + i;
-						if ( the_k >= kmin && the_k <= kmax && the_n <= l_nmax ){
-							int s = (kpos==k0)?-1:1;
-							if( goodfactor(the_k, the_n, s)){
-								int I = atomic_inc(&factorCnt[0]);
-								factorP[I] = (s==1) ? (long)my_P : -((long)my_P);
-								factorKN[I] = (uint2){ the_k, the_n };
+	uint stride = get_global_size(0);
+
+	// one pass, or a grid-stride loop when the host launches fewer work-items than primes (persistent mode)
+	for(uint first = gid; first < pcnt; first += stride * LANES){
+		uint lanes = min( (uint)LANES, (pcnt - first + stride - 1) / stride );
+		ulong k0[LANES], my_P[LANES];
+		uint Psh[LANES];
+
+		LANE_LOOP
+		for(uint j = 0; j < LANES; ++j){
+			uint idx = (j < lanes) ? first + j * stride : first;
+			k0[j] = g_K[idx];
+			my_P[j] = base + g_P[idx];
+			Psh[j] = (uint)g_Ps[idx];
+		}
+
+		n = N;
+
+		SIEVE_UNROLL
+		do {
+			LANE_LOOP
+			for(uint j = 0; j < LANES; ++j){
+				// Select the even one.
+				kpos = (((uint)k0[j]) & 1)?(my_P[j] - k0[j]):k0[j];
+
+				i = (uint)(kpos);
+				if(i != 0){
+					i = __ctz(i);
+					if(i <= NSTEP){
+						if ((((uint)(kpos >> 32))>>i) == 0) {
+							uint the_k = (uint)(kpos >> i);
+							uint the_n = n + i;
+							if ( the_k >= KMIN && the_k <= KMAX && the_n <= l_nmax ){
+								int s = (kpos==k0[j])?-1:1;
+								if( j < lanes && goodfactor(the_k, the_n, s)){
+									stage_factor(&l_cnt, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors, (s==1) ? (long)my_P[j] : -((long)my_P[j]), (uint2){ the_k, the_n });
+								}
 							}
 						}
+						// if (kpos >> 32))>>i > 0, k is larger than uint.
 					}
-					// if (kpos >> 32))>>i > 0, k is larger than uint.
 				}
+				// if lower 32 bits of kpos are zero, then i will be >= 32 > nstep
+
+				// Proceed to the K for the next N.
+				k0[j] = shiftmod_REDCsm(k0[j], my_P[j], ((uint)k0[j])*Psh[j], sm_mont_nstep, NSTEP);
 			}
-			// if lower 32 bits of kpos are zero, then i will be >= 32 > nstep
 
-			// Proceed to the K for the next N.
-			n += nstep;
-			k0 = shiftmod_REDCsm(k0, my_P, ((uint)k0)*Psh, sm_mont_nstep, nstep);
+			n += NSTEP;
 
 		} while (n < l_nmax);
 
 
-		g_K[gid] = k0;  // store k0 to global array
+		// store k0 to global array
+		LANE_LOOP
+		for(uint j = 0; j < LANES; ++j){
+			if(j < lanes){
+				g_K[first + j * stride] = k0[j];
+			}
+		}
 
 	}
 
-}
-
+	flush_factors(&l_cnt, &l_pos, l_P, l_KN, factorCnt, factorP, factorKN, maxfactors);
 
+}
 
 
+// helpers are defined once, the next lane count only adds its kernels
+#define SIEVE_HELPERS
+#undef LANES
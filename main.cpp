@@ -25,9 +25,15 @@
 #include "primesieve.h"
 #include "putil.h"
 #include "cl_sieve.h"
+#include "cpu_sieve.h"
 
 using namespace std; 
 
+// core in OpenCL 1.2, the cl_khr_fp64 device query before that
+#ifndef CL_DEVICE_DOUBLE_FP_CONFIG
+	#define CL_DEVICE_DOUBLE_FP_CONFIG 0x1032
+#endif
+
 
 void help()
 {
@@ -40,12 +46,22 @@ void help()
 	printf("-N # 			Sieve for primes k*2^n+/-1 with 65 <= -n <= n <= -N < 2^32\n");
 	printf("-c 			Search for Cullen/Woodall factors\n");
 	printf("-s or --test		Perform self test to verify proper operation of the program.\n");
+	printf("-C or --cpu		Use the multithreaded CPU sieve instead of OpenCL\n");
+	printf("-t # or --nthreads #	Number of CPU threads, default is all hardware threads.  OpenCL factor verification threads, default up to 4\n");
+	printf("-S # or --simd #		Widest CPU vector unit to use, 0 scalar, 1 AVX2, 2 AVX-512, 3 FP64 FMA, default 3\n");
+	printf("			4 always uses the FP64 sieve for P < 2^50, on the CPU or OpenCL, without timing it\n");
+	printf("-F or --fused		Generate primes and set up Ps and K in one kernel\n");
+	printf("-B or --bench		Benchmark the OpenCL prime generator's presieve depth at -p\n");
+	printf("-b file or --boxes file	Search each k,n box in file over -p to -P with one prime stream\n");
+	printf("-T # or --ktime #	Target OpenCL kernel time in ms, default 10\n");
+	printf("-w # or --spin #		Poll for up to # us before sleeping on a GPU wait, default 0\n");
+	printf("-v or --verbose		Print OpenCL build logs, profile and retune details, and per-batch stats\n");
 	printf("-h			Print this help\n");
         boinc_finish(EXIT_FAILURE);
 }
 
 
-static const char *short_opts = "p:P:k:K:n:N:csd:h";
+static const char *short_opts = "p:P:k:K:n:N:csd:hCt:S:BFb:T:w:v";
 
 static int parse_option(int opt, char *arg, const char *source, searchData & sd)
 {
@@ -92,6 +108,44 @@ static int parse_option(int opt, char *arg, const char *source, searchData & sd)
     case 'd':
       break;
 
+    case 'C':
+      sd.cpu = true;
+      fprintf(stderr,"Using CPU sieve.\n");
+      printf("Using CPU sieve.\n");
+      break;
+
+    case 't':
+      status = parse_uint(&sd.threads,arg,1,1024);
+      break;
+
+    case 'S':
+      status = parse_uint(&sd.simd,arg,0,4);
+      break;
+
+    case 'B':
+      sd.bench = true;
+      break;
+
+    case 'F':
+      sd.fused = true;
+      break;
+
+    case 'b':
+      sd.boxfile = arg;
+      break;
+
+    case 'T':
+      status = parse_uint(&sd.ktime,arg,1,1000);
+      break;
+
+    case 'w':
+      status = parse_uint(&sd.spin,arg,0,100000);
+      break;
+
+    case 'v':
+      sd.verbose = true;
+      break;
+
     case 'h':
       help();
       break;
@@ -107,6 +161,15 @@ static int parse_option(int opt, char *arg, const char *source, searchData & sd)
 static const struct option long_opts[] = {
   {"device",  optional_argument, 0, 'd'},		// handle --device arg, but it's not used
   {"test",  no_argument, 0, 's'},
+  {"cpu",  no_argument, 0, 'C'},
+  {"nthreads",  required_argument, 0, 't'},		// BOINC multithreaded app thread count
+  {"simd",  required_argument, 0, 'S'},
+  {"bench",  no_argument, 0, 'B'},
+  {"fused",  no_argument, 0, 'F'},
+  {"boxes",  required_argument, 0, 'b'},
+  {"ktime",  required_argument, 0, 'T'},
+  {"spin",  required_argument, 0, 'w'},
+  {"verbose",  no_argument, 0, 'v'},
   {0,0,0,0}
 };
 
@@ -233,6 +296,24 @@ int main(int argc, char *argv[])
 
 	process_args(argc,argv,sd);
 
+	// CPU engine doesn't need an OpenCL device
+	if(sd.cpu){
+		if(sd.boxfile != NULL){
+			printf("--boxes needs the OpenCL sieve\n");
+			fprintf(stderr, "--boxes needs the OpenCL sieve\n");
+			boinc_finish(EXIT_FAILURE);
+		}
+		if(sd.test == true){
+			run_test(hardware, sd);
+		}
+		else{
+			cpu_sieve(sd);
+		}
+
+		boinc_finish(EXIT_SUCCESS);
+
+		return 0;
+	}
 
 	cl_platform_id platform = 0;
 	cl_device_id device = 0;
@@ -253,6 +334,11 @@ int main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 			err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
+			// CPU OpenCL, e.g. for --bench
+			if (err == CL_DEVICE_NOT_FOUND) {
+				printf("No OpenCL GPU found, using the first OpenCL device.\n");
+				err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
+			}
 			if (err != CL_SUCCESS) {
 				printf( "clGetDeviceIDs() failed with %d\n", err );
 				fprintf(stderr, "Error: clGetDeviceIDs() failed with %d\n", err );
@@ -288,6 +374,13 @@ int main(int argc, char *argv[])
 	hardware.queue = queue;
 	hardware.context = ctx;
 
+	// cache compiled kernels in the project directory, the slot directory is cleaned after each task
+	if(!boinc_is_standalone()){
+		APP_INIT_DATA aid;
+		boinc_get_init_data(aid);
+		sclSetBinaryCache(aid.project_dir);
+	}
+
  	char device_name[1024];
  	char device_vend[1024];
  	char device_driver[1024];
@@ -409,11 +502,19 @@ int main(int argc, char *argv[])
 
 	sd.computeunits = computeunits;
 
+	// double precision, for the FP64 sieve kernels at p < 2^50
+	cl_device_fp_config fpconfig = 0;
+	err = clGetDeviceInfo(device, CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(fpconfig), &fpconfig, NULL);
+	sd.fp64 = (err == CL_SUCCESS && (fpconfig & CL_FP_FMA) != 0);
+
 	
 	if(sd.test == true){
 		run_test(hardware, sd);
 
 	}
+	else if(sd.bench){
+		bench_presieve(hardware, sd);
+	}
 	else{
 		cl_sieve(hardware, sd);
 	}
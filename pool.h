@@ -0,0 +1,98 @@
+// pool.h
+
+// fixed size thread pool, used by the CPU engine's sieve and by the OpenCL path's factor verification.
+// start() hands out items 0..count-1 to the workers through an atomic counter and returns at once,
+// finished() polls and wait() blocks.  run() also works on the items in the calling thread and returns
+// when all are complete.  the job gets the item and the thread, 0 to workers-1, the caller is workers.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+class workPool {
+
+public:
+	workPool( uint32_t nworkers ) {
+		for(uint32_t t = 0; t < nworkers; ++t){
+			workers.push_back( std::thread(&workPool::worker, this, t) );
+		}
+	}
+
+	~workPool(){
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			quit = true;
+		}
+		wake.notify_all();
+		for(auto & w : workers){
+			w.join();
+		}
+	}
+
+	void start( uint32_t count, std::function<void(uint32_t, uint32_t)> work ){
+		std::unique_lock<std::mutex> lock(mtx);
+		done.wait(lock, [this]{ return busy == 0; });
+		job = work;
+		total = count;
+		next = 0;
+		left = count;
+		busy = (uint32_t)workers.size();
+		++generation;
+		lock.unlock();
+		wake.notify_all();
+	}
+
+	void run( uint32_t count, std::function<void(uint32_t, uint32_t)> work ){
+		start(count, work);
+		runItems((uint32_t)workers.size());
+		wait();
+	}
+
+	bool finished(){
+		return left == 0;
+	}
+
+	void wait(){
+		std::unique_lock<std::mutex> lock(mtx);
+		done.wait(lock, [this]{ return busy == 0; });
+	}
+
+private:
+	void runItems( uint32_t tid ){
+		for(uint32_t i; (i = next.fetch_add(1)) < total; ){
+			job(i, tid);
+			--left;
+		}
+	}
+
+	void worker( uint32_t tid ){
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(mtx);
+		while(true){
+			wake.wait(lock, [&]{ return quit || generation != seen; });
+			if(quit) return;
+			seen = generation;
+			lock.unlock();
+			runItems(tid);
+			lock.lock();
+			if(--busy == 0){
+				done.notify_all();
+			}
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex mtx;
+	std::condition_variable wake, done;
+	std::function<void(uint32_t, uint32_t)> job;
+	std::atomic<uint32_t> next{0};
+	std::atomic<uint32_t> left{0};
+	uint32_t total = 0;
+	uint32_t busy = 0;
+	uint64_t generation = 0;
+	bool quit = false;
+
+};
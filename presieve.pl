@@ -0,0 +1,84 @@
+#!/usr/bin/perl
+# Generate the getsegprimes presieve tables as OpenCL code.
+# Usage: presieve.pl <limit> > kernels/presieve.cl
+# Tables cover the odd primes 3 <= p <= limit.  The host picks how many of them are used
+# with -D PRESIEVE_PRIMES, so one build covers every presieve depth up to limit.
+use strict;
+
+my $args = @ARGV;
+
+if ($args != 1 || $ARGV[0] !~ /^\d+$/ || $ARGV[0] < 13 || $ARGV[0] > 65535) {
+	print STDERR "usage: presieve.pl <limit>, 13 <= limit <= 65535\n";
+	exit 1;
+}
+
+my $limit = $ARGV[0];
+
+# odd primes to limit
+my @composite;
+my @primes;
+for (my $n = 3; $n <= $limit; $n += 2) {
+	next if $composite[$n];
+	push @primes, $n;
+	for (my $m = $n * $n; $m <= $limit; $m += 2 * $n) {
+		$composite[$m] = 1;
+	}
+}
+
+my $count = @primes;
+
+# Each work-item sieves a window of 64 odd numbers.  Bound the survivors of a window using
+# the primes to 13, which every build presieves, by trying every alignment mod 3*5*7*11*13.
+# Windows at the start keep 3..13 themselves.
+my $wheel = 15015;
+my $survivors = 0;
+for (my $s = 1; $s < 2 * $wheel; $s += 2) {
+	my $left = 0;
+	for (my $j = 0; $j < 64; ++$j) {
+		my $n = $s + 2 * $j;
+		my $keep = ($n == 3 || $n == 5 || $n == 7 || $n == 11 || $n == 13);
+		$left++ if $keep || ($n % 3 && $n % 5 && $n % 7 && $n % 11 && $n % 13);
+	}
+	$survivors = $left if $left > $survivors;
+}
+
+# pattern[i] has a bit every p, step[i] is 128 mod p, the residue change from one work-item to the next
+my @pattern;
+my @step;
+foreach my $p (@primes) {
+	my ($hi, $lo) = (0, 0);
+	for (my $b = 0; $b < 64; $b += $p) {
+		if ($b < 32) { $lo |= 1 << $b; } else { $hi |= 1 << ($b - 32); }
+	}
+	push @pattern, sprintf("0x%08x%08xUL", $hi, $lo);
+	push @step, 128 % $p;
+}
+
+sub table {
+	my ($type, $name, @values) = @_;
+	my $out = "__constant $type $name\[$count\] = {\n";
+	for (my $i = 0; $i < @values; $i += 8) {
+		my $last = ($i + 8 >= @values) ? $#values : $i + 7;
+		$out .= "\t" . join(", ", @values[$i .. $last]) . (($last == $#values) ? "\n" : ",\n");
+	}
+	return $out . "};\n\n";
+}
+
+print <<EOF;
+/*
+
+	presieve tables for getsegprimes
+
+	Generated by presieve.pl $limit, do not edit.
+
+*/
+
+#define PRESIEVE_MAX_PRIMES $count
+#define PRESIEVE_MAX_LIMIT $primes[-1]
+#define PRESIEVE_MAX_SURVIVORS $survivors
+
+EOF
+
+print table("uint", "presieve_prime", @primes);
+print table("ulong", "presieve_pattern", @pattern);
+print table("uint", "presieve_step", @step);
@@ -27,6 +27,16 @@ extern "C" {
 
 #include "simpleCL.h"
 
+#include <time.h>
+#include <dirent.h>
+#include <utime.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
 void sclPrintErrorFlags( cl_int flag ){
     
 	switch (flag){
@@ -351,39 +361,268 @@ void sclPrintErrorFlags( cl_int flag ){
 
 void sclGetBinary( sclSoft software ){
 
+	if( !_sclSaveBinary( software.program, software.kernelName ) ){
+		printf( "Error: cannot write binary: %s\n", software.kernelName );
+		fprintf( stderr, "Error: cannot write binary: %s\n", software.kernelName );
+	}
+
+}
+
+
+/* ####### kernel binary cache ############################ */
+
+// directory for cached program binaries, "" is the working directory, NULL disables the cache
+static char scl_cachedir[512] = "";
+static int scl_cache = 1;
+
+// binaries not used for this many days are removed, and only the most recently used are kept
+#define SCL_CACHE_DAYS 30
+#define SCL_CACHE_MAX 64
+
+void sclSetBinaryCache( const char* dir ){
+
+	if( dir == NULL ){
+		scl_cache = 0;
+		return;
+	}
+
+	scl_cache = 1;
+	snprintf( scl_cachedir, sizeof(scl_cachedir), "%s", dir );
+
+}
+
+
+// FNV-1a
+static uint64_t _sclHash( uint64_t h, const char* str ){
+
+	if( str != NULL ){
+		for( ; *str; ++str ){
+			h ^= (unsigned char)*str;
+			h *= 0x100000001b3ULL;
+		}
+	}
+	h ^= 0xff;
+	h *= 0x100000001b3ULL;
+
+	return h;
+}
+
+
+// hash of the device name and driver version, changes when either does
+uint64_t sclGetDeviceHash( sclHard hardware ){
+
+	char device_name[1024] = "";
+	char device_driver[1024] = "";
+
+	clGetDeviceInfo( hardware.device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL );
+	clGetDeviceInfo( hardware.device, CL_DRIVER_VERSION, sizeof(device_driver), device_driver, NULL );
+
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	h = _sclHash( h, device_name );
+	h = _sclHash( h, device_driver );
+
+	return h;
+}
+
+
+// key is the device name, driver version, build options and kernel source
+uint64_t _sclCacheKey( const char* source, sclHard hardware, const char* build_opt ){
+
+	uint64_t h = sclGetDeviceHash( hardware );
+
+	h = _sclHash( h, build_opt );
+	h = _sclHash( h, source );
+
+	return h;
+}
+
+
+void _sclCacheFileName( char* filename, size_t size, uint64_t key ){
+
+	if( scl_cachedir[0] ){
+		snprintf( filename, size, "%s/sclcache_%016llx.bin", scl_cachedir, (unsigned long long)key );
+	}
+	else{
+		snprintf( filename, size, "sclcache_%016llx.bin", (unsigned long long)key );
+	}
+
+}
+
+
+// write the program binary for the first device.  returns 0 on failure.
+int _sclSaveBinary( cl_program program, const char* filename ){
+
 	size_t size;
 	cl_int err;
 
-	err = clGetProgramInfo( software.program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL );
-	if ( err!=CL_SUCCESS ) {
-		printf( "Error: clGetProgramInfo\n" );
-		fprintf(stderr, "Error: clGetProgramInfo\n" );
-		sclPrintErrorFlags( err );
+	err = clGetProgramInfo( program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL );
+	if ( err != CL_SUCCESS || size == 0 ) {
+		return 0;
 	}
 
 	unsigned char * binary = new unsigned char [ size ];
 
-	err = clGetProgramInfo( software.program, CL_PROGRAM_BINARIES, size, &binary, NULL );
-	if ( err!=CL_SUCCESS ) {
-		printf( "Error: clGetProgramInfo\n" );
-		fprintf(stderr, "Error: clGetProgramInfo\n" );
-		sclPrintErrorFlags( err );
+	err = clGetProgramInfo( program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, NULL );
+	if ( err != CL_SUCCESS ) {
+		delete [ ] binary;
+		return 0;
 	}
 
-	FILE * fpbin = fopen( software.kernelName, "wb" );
+	// write to a temporary file and rename it, so another task never reads a partial binary.
+	// the name is per process, tasks sharing the cache directory may write the same binary at once.
+	char tmpname[1024];
+	snprintf( tmpname, sizeof(tmpname), "%s.%d.tmp", filename, (int)getpid() );
+
+	FILE * fpbin = fopen( tmpname, "wb" );
 	if( fpbin == NULL ){
-		printf( "Error: cannot write binary: %s\n", software.kernelName );
-		fprintf( stderr, "Error: cannot write binary: %s\n", software.kernelName );
+		delete [ ] binary;
+		return 0;
+	}
+
+	size_t written = fwrite( binary, 1, size, fpbin );
+	fclose( fpbin );
+	delete [ ] binary;
+
+	if( written != size || rename( tmpname, filename ) != 0 ){
+		remove( tmpname );
+		return 0;
+	}
+
+	return 1;
+}
+
+
+// remove cached binaries unused for SCL_CACHE_DAYS, then the least recently used past SCL_CACHE_MAX.
+// temporary files a crashed writer left behind go after a day.
+void _sclPruneCache( void ){
+
+	const char * dir = ( scl_cachedir[0] ) ? scl_cachedir : ".";
+
+	DIR * d = opendir( dir );
+	if( d == NULL ){
+		return;
+	}
+
+	char name[SCL_CACHE_MAX + 1][1024];
+	time_t used[SCL_CACHE_MAX + 1];
+	int count = 0;
+
+	time_t now = time( NULL );
+	struct dirent * e;
+	struct stat st;
+
+	while( ( e = readdir( d ) ) != NULL ){
+
+		if( strncmp( e->d_name, "sclcache_", 9 ) != 0 ){
+			continue;
+		}
+
+		char path[1024];
+		snprintf( path, sizeof(path), "%s/%s", dir, e->d_name );
+
+		if( stat( path, &st ) != 0 ){
+			continue;
+		}
+
+		double age = difftime( now, st.st_mtime );
+		size_t len = strlen( e->d_name );
+
+		if( len > 4 && strcmp( e->d_name + len - 4, ".tmp" ) == 0 ){
+			if( age > 86400.0 ){
+				remove( path );
+			}
+			continue;
+		}
+
+		if( age > SCL_CACHE_DAYS * 86400.0 ){
+			remove( path );
+			continue;
+		}
+
+		// keep the SCL_CACHE_MAX newest, drop the oldest of a full list
+		if( count == SCL_CACHE_MAX + 1 ){
+			int oldest = 0;
+			for( int i = 1; i < count; ++i ){
+				if( used[i] < used[oldest] ) oldest = i;
+			}
+			remove( name[oldest] );
+			--count;
+			snprintf( name[oldest], sizeof(name[oldest]), "%s", name[count] );
+			used[oldest] = used[count];
+		}
+
+		snprintf( name[count], sizeof(name[count]), "%s", path );
+		used[count] = st.st_mtime;
+		++count;
+	}
+
+	closedir( d );
+
+	if( count > SCL_CACHE_MAX ){
+		int oldest = 0;
+		for( int i = 1; i < count; ++i ){
+			if( used[i] < used[oldest] ) oldest = i;
+		}
+		remove( name[oldest] );
+	}
+
+}
+
+
+// create and build a program from a cached binary.  returns NULL on a miss or if the driver rejects it.
+cl_program _sclLoadBinary( const char* filename, sclHard hardware, const char* build_opt ){
+
+	FILE * fpbin = fopen( filename, "rb" );
+	if( fpbin == NULL ){
+		return NULL;
 	}
-	else
-	{
-		fwrite( binary, 1, size, fpbin );
+
+	fseek( fpbin, 0, SEEK_END );
+	long fsize = ftell( fpbin );
+	fseek( fpbin, 0, SEEK_SET );
+
+	if( fsize <= 0 ){
 		fclose( fpbin );
+		return NULL;
 	}
+
+	size_t size = (size_t)fsize;
+	unsigned char * binary = new unsigned char [ size ];
+
+	size_t x = fread( binary, 1, size, fpbin );
+	fclose( fpbin );
+
+	if( x != size ){
+		delete [ ] binary;
+		return NULL;
+	}
+
+	cl_int err, status;
+	const unsigned char * bin = binary;
+
+	cl_program program = clCreateProgramWithBinary( hardware.context, 1, &hardware.device, &size, &bin, &status, &err );
 	delete [ ] binary;
 
+	if( err != CL_SUCCESS || status != CL_SUCCESS ){
+		if( program != NULL ) clReleaseProgram( program );
+		return NULL;
+	}
+
+	err = clBuildProgram( program, 0, NULL, build_opt, NULL, NULL );
+	if( err != CL_SUCCESS ){
+		clReleaseProgram( program );
+		return NULL;
+	}
+
+	// mark it used, so the cache pruning keeps it
+	utime( filename, NULL );
+
+	return program;
 }
 
+/* ######################################################## */
+
 
 char* _sclLoadProgramSource( const char *filename )
 { 
@@ -426,19 +665,25 @@ cl_program _sclCreateProgram( const char* program_source, cl_context context )
 	return program;
 }
 
-void _sclBuildProgram( cl_program program, cl_device_id devices, const char* pName, int opt )
+void _sclBuildOptions( char* build_opt, size_t size, int opt, const char* options ){
+
+	snprintf( build_opt, size, "%s%s", (opt) ? "" : "-cl-opt-disable ", (options != NULL) ? options : "" );
+
+}
+
+
+// options is an extra build option string, such as -D defines, or NULL
+void _sclBuildProgram( cl_program program, cl_device_id devices, const char* pName, int opt, const char* options )
 {
 	cl_int err;
 	char build_c[4096];
+	char build_opt[1024];
 	
 //	err = clBuildProgram( program, 0, NULL, NULL, NULL, NULL );
 
-	if(opt){
-		err = clBuildProgram( program, 0, NULL, NULL, NULL, NULL );
-	}
-	else{
-		err = clBuildProgram( program, 0, NULL, "-cl-opt-disable", NULL, NULL );
-	}
+	_sclBuildOptions( build_opt, sizeof(build_opt), opt, options );
+
+	err = clBuildProgram( program, 0, NULL, build_opt, NULL, NULL );
 
 
 	// print nvidia kernel buld log
@@ -534,6 +779,18 @@ double ProfilesclEnqueueKernel( sclHard hardware, sclSoft software) {
 }
 
 
+// run time in ms of a finished launch, from its event timestamps
+double sclEventTime( cl_event event ) {
+	cl_ulong time_start;
+	cl_ulong time_end;
+
+	clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+	clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+
+	return (time_end-time_start) / 1000000.0;
+}
+
+
 void sclSetGlobalSize( sclSoft & software, uint64_t size ) {
 
 	software.global_size[0] = (size / software.local_size[0]) * software.local_size[0];
@@ -603,9 +860,11 @@ unsigned long int _sclGetMaxGlobalMemSize( cl_device_id device ){
 
 
 // Bryan Little added opt flag to turn on/off optimizations during kernel compile
-sclSoft sclGetCLSoftware( const char* source, const char* name, sclHard hardware, int opt, int debuginfo ){
+// options is passed to the OpenCL compiler, NULL for none
+// returns a built program, from the binary cache when possible.  name is used for messages.
+cl_program sclGetCLProgram( const char* source, const char* name, sclHard hardware, int opt, int debuginfo, const char* options ){
 
-	sclSoft software;
+	cl_program program;
 
 	if(debuginfo){
 		if(opt){
@@ -614,22 +873,64 @@ sclSoft sclGetCLSoftware( const char* source, const char* name, sclHard hardware
 		else{
 			printf("Compiling %s with -cl-opt-disable...\n", name);
 		}
+		if(options != NULL){
+			printf("Build options: %s\n", options);
+		}
 	}
 
-	sprintf( software.kernelName, "%s", name);
-	
-	/* Create program objects from source
+	/* Load a cached binary built with the same source, options, device and driver
 	 ########################################################### */
-	software.program = _sclCreateProgram( source, hardware.context );
-	/* ########################################################### */
-	
-	/* Build the program (compile it)
-   	 ############################################ */
+	char build_opt[1024];
+	char cachefile[1024];
+
+	_sclBuildOptions( build_opt, sizeof(build_opt), opt, options );
+	_sclCacheFileName( cachefile, sizeof(cachefile), _sclCacheKey( source, hardware, build_opt ) );
+
+	program = (scl_cache) ? _sclLoadBinary( cachefile, hardware, build_opt ) : NULL;
+
+	if( program != NULL ){
+		if(debuginfo){
+			printf("\tLoaded cached binary %s\n", cachefile);
+		}
+	}
+	else{
+		/* Create program objects from source
+		 ########################################################### */
+		program = _sclCreateProgram( source, hardware.context );
+		/* ########################################################### */
+
+		/* Build the program (compile it)
+	   	 ############################################ */
+
+	   	_sclBuildProgram( program, hardware.device, name, opt, options );
+	   	/* ############################################ */
+
+		if( scl_cache ){
+			if( _sclSaveBinary( program, cachefile ) ){
+				_sclPruneCache();
+			}
+			else if(debuginfo){
+				printf("\tUnable to cache binary %s\n", cachefile);
+			}
+		}
+	}
 
-   	_sclBuildProgram( software.program, hardware.device, name, opt );
-   	/* ############################################ */
-   	
-   	/* Create the kernel object
+	return program;
+
+}
+
+
+// create kernel 'name' from a built program.  the sclSoft holds its own reference to the program.
+sclSoft sclGetCLKernel( cl_program program, const char* name, sclHard hardware, int debuginfo ){
+
+	sclSoft software;
+
+	sprintf( software.kernelName, "%s", name);
+
+	software.program = program;
+	clRetainProgram( program );
+
+	/* Create the kernel object
 	 ########################################################################## */
 	software.kernel = _sclCreateKernel( software );
 	/* ########################################################################## */
@@ -649,10 +950,24 @@ sclSoft sclGetCLSoftware( const char* source, const char* name, sclHard hardware
 	software.local_size[0] = workgroupsize;
 
 	if(debuginfo){
-		printf("\tKernel workgroup size: %u\n", (unsigned int)workgroupsize);
+		printf("\t%s workgroup size: %u\n", name, (unsigned int)workgroupsize);
 	}
 
 	return software;
+
+}
+
+
+// build a program holding the single kernel 'name'
+sclSoft sclGetCLSoftware( const char* source, const char* name, sclHard hardware, int opt, int debuginfo, const char* options ){
+
+	cl_program program = sclGetCLProgram( source, name, hardware, opt, debuginfo, options );
+
+	sclSoft software = sclGetCLKernel( program, name, hardware, debuginfo );
+
+	clReleaseProgram( program );
+
+	return software;
 	
 }
 
@@ -697,6 +1012,57 @@ void sclRead( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer )
 
 }
 
+// the read completes in queue order, hostPointer must stay valid until then
+void sclReadNonBlocking( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer ) {
+
+	cl_int err;
+
+	err = clEnqueueReadBuffer( hardware.queue, buffer, CL_FALSE, 0, size, hostPointer, 0, NULL, NULL );
+	if ( err != CL_SUCCESS ) {
+		printf( "\nclRead Error\n" );
+		fprintf(stderr, "\nclRead Error\n" );
+		sclPrintErrorFlags( err );
+       	}
+
+}
+
+// host memory the device copies to directly.  a CL_MEM_ALLOC_HOST_PTR buffer, mapped until sclFreePinned
+cl_mem sclMallocPinned( sclHard hardware, size_t size, void **hostPointer ) {
+
+	cl_int err;
+
+	cl_mem buffer = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		printf( "\nclCreateBuffer Error\n" );
+		fprintf(stderr, "\nclCreateBuffer Error\n" );
+		sclPrintErrorFlags( err );
+	}
+
+	*hostPointer = clEnqueueMapBuffer( hardware.queue, buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, NULL, NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		printf( "\nclEnqueueMapBuffer Error\n" );
+		fprintf(stderr, "\nclEnqueueMapBuffer Error\n" );
+		sclPrintErrorFlags( err );
+	}
+
+	return buffer;
+}
+
+void sclFreePinned( sclHard hardware, cl_mem buffer, void *hostPointer ) {
+
+	cl_int err;
+
+	if(buffer != NULL){
+		err = clEnqueueUnmapMemObject( hardware.queue, buffer, hostPointer, 0, NULL, NULL );
+		if ( err != CL_SUCCESS ) {
+			printf( "\nclEnqueueUnmapMemObject Error\n" );
+			fprintf(stderr, "\nclEnqueueUnmapMemObject Error\n" );
+			sclPrintErrorFlags( err );
+		}
+		sclReleaseMemObject( buffer );
+	}
+}
+
 cl_int sclFinish( sclHard hardware ){
 
 	cl_int err;
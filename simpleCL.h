@@ -65,6 +65,8 @@ typedef struct {
 /* USER FUNCTIONS */
 
 void sclGetBinary( sclSoft software );
+void sclSetBinaryCache( const char* dir );
+uint64_t sclGetDeviceHash( sclHard hardware );
 void sclSetGlobalSize( sclSoft & software, uint64_t size );
 
 /* ####### Device memory allocation read and write  ####### */
@@ -73,11 +75,16 @@ void sclSetGlobalSize( sclSoft & software, uint64_t size );
 void			sclWriteBlocking( sclHard hardware, size_t size, cl_mem buffer, void* hostPointer );
 void 			sclWrite( sclHard hardware, size_t size, cl_mem buffer, void* hostPointer );
 void			sclRead( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer );
+void			sclReadNonBlocking( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer );
+cl_mem			sclMallocPinned( sclHard hardware, size_t size, void **hostPointer );
+void			sclFreePinned( sclHard hardware, cl_mem buffer, void *hostPointer );
 
 /* ######################################################## */
 
 /* ####### inicialization of sclSoft structs  ############## */
-sclSoft 		sclGetCLSoftware( const char* source, const char* name, sclHard hardware, int opt, int debuginfo );
+sclSoft 		sclGetCLSoftware( const char* source, const char* name, sclHard hardware, int opt, int debuginfo, const char* options );
+cl_program 		sclGetCLProgram( const char* source, const char* name, sclHard hardware, int opt, int debuginfo, const char* options );
+sclSoft 		sclGetCLKernel( cl_program program, const char* name, sclHard hardware, int debuginfo );
 
 /* ######################################################## */
 
@@ -100,6 +107,7 @@ void 			sclPrintErrorFlags( cl_int flag );
 void			sclEnqueueKernel( sclHard hardware, sclSoft software );
 cl_event		sclEnqueueKernelEvent( sclHard hardware, sclSoft software );
 double			ProfilesclEnqueueKernel( sclHard hardware, sclSoft software );
+double			sclEventTime( cl_event event );
 
 /* ######################################################## */
 
@@ -122,11 +130,21 @@ void 			sclSetKernelArg( sclSoft software, int argnum, size_t typeSize, void *ar
 /* INTERNAL FUNCITONS */
 
 /* ####### cl software management ######################### */
-void 			_sclBuildProgram( cl_program program, cl_device_id devices, const char* pName, int opt );
+void 			_sclBuildProgram( cl_program program, cl_device_id devices, const char* pName, int opt, const char* options );
+void 			_sclBuildOptions( char* build_opt, size_t size, int opt, const char* options );
 cl_kernel 		_sclCreateKernel( sclSoft software );
 cl_program 		_sclCreateProgram( const char* program_source, cl_context context );
 char* 			_sclLoadProgramSource( const char *filename );
 
+/* ######################################################## */
+
+/* ####### kernel binary cache ############################ */
+uint64_t 		_sclCacheKey( const char* source, sclHard hardware, const char* build_opt );
+void 			_sclCacheFileName( char* filename, size_t size, uint64_t key );
+int 			_sclSaveBinary( cl_program program, const char* filename );
+cl_program 		_sclLoadBinary( const char* filename, sclHard hardware, const char* build_opt );
+void			_sclPruneCache( void );
+
 /* ######################################################## */
 
 /* ####### hardware management ############################ */